@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "image.hpp"
+#include "job.hpp"
+#include "log.hpp"
+#include "texture_cache.hpp"
+
+
+/// Many jobs in one process, from a manifest of one job per line (see `Job::parse`, `#` starts a comment), run by a
+/// number of workers sharing a texture cache. Console output is a line per job, the jobs themselves are quiet.
+class Batch {
+public:
+    /// Run the manifest, return the number of failed jobs
+    [[nodiscard]] static int run(const std::string &manifest, int workers, const std::vector<std::string> &defaults,
+                                 TextureCache &cache) {
+        std::ifstream file(manifest);
+        if (not file) {
+            std::cerr << "Unable to read manifest from " << manifest << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+
+        // Parse everything first, a malformed line stops the batch before any work
+        std::vector<Job> jobs;
+        std::string line;
+        for (int line_number = 1; std::getline(file, line); ++ line_number) {
+            line = line.substr(0, line.find('#'));
+            if (line.find_first_not_of(" \t\r") == std::string::npos) {
+                continue;
+            }
+            Job job;
+            std::string error;
+            if (not Job::parse(line, defaults, job, error)) {
+                std::cerr << manifest << ":" << line_number << ": " << error << std::endl;
+                std::exit(EXIT_FAILURE);
+            }
+            jobs.push_back(std::move(job));
+        }
+
+        workers = std::max(1, std::min<int>(workers, jobs.size()));
+        std::cout << "Running " << jobs.size() << " jobs with " << workers << " workers ..." << std::endl;
+        Log::instance().set_verbosity(Verbosity::quiet);
+
+        std::atomic<int> next = 0, finished = 0, failures = 0;
+        std::mutex output;
+        NanoTimer timer;
+        auto worker = [&]() {
+            for (int i; (i = next ++) < jobs.size();) {
+                const auto &job = jobs[i];
+                NanoTimer job_timer;
+                auto texture = cache.get(job.input);
+                if (not texture) {
+                    ++ failures;
+                    std::lock_guard<std::mutex> guard(output);
+                    std::cerr << "[" << ++ finished << "/" << jobs.size() << "] Unable to load image from " << job.input << std::endl;
+                    continue;
+                }
+                auto result = synthesize(job, texture);
+                std::lock_guard<std::mutex> guard(output);
+                if (not result.error.empty()) {
+                    ++ failures;
+                    std::cerr << "[" << ++ finished << "/" << jobs.size() << "] " << result.error << std::endl;
+                    continue;
+                }
+                std::cout << "[" << ++ finished << "/" << jobs.size() << "] " << job.input << " -> " << job.output << " ("
+                          << job.w << "x" << job.h << "): seam cost " << result.initial_seam_cost << " -> "
+                          << result.final_seam_cost << " in " << pretty_nanoseconds(job_timer.tik()) << std::endl;
+                std::cout << result.graph_stats;
+            }
+        };
+        std::vector<std::thread> threads;
+        for (int i = 0; i < workers; ++ i) {
+            threads.emplace_back(worker);
+        }
+        for (auto &thread: threads) {
+            thread.join();
+        }
+
+        std::cout << "Finished " << jobs.size() - failures << " of " << jobs.size() << " jobs in "
+                  << pretty_nanoseconds(timer.tik()) << std::endl;
+        return failures;
+    }
+};
@@ -1,14 +1,19 @@
 #pragma once
 
+#include <algorithm>
+#include <cassert>
 #include <cctype>
 #include <chrono>
+#include <cstring>
 #include <iostream>
 #include <filesystem>
+#include <optional>
 #include <ostream>
 #include <random>
 #include <set>
 #include <string>
 #include <type_traits>
+#include <vector>
 
 
 // Returning a const value is not recommended by Clang-Tidy for readability, but for functionality we need it
@@ -17,21 +22,26 @@
 #pragma ide diagnostic ignored "OCUnusedMacroInspection"
 
 
-/// A nanosecond-level timer
+/// A nanosecond-level timer on the monotonic clock, so clock adjustments do not skew measurements
 class [[maybe_unused]] NanoTimer {
 private:
-    typedef std::chrono::time_point<std::chrono::system_clock, std::chrono::nanoseconds> time_point_t;
+    typedef std::chrono::time_point<std::chrono::steady_clock, std::chrono::nanoseconds> time_point_t;
 
     time_point_t last_time_point;
 
 public:
     [[maybe_unused]] NanoTimer() {
-        last_time_point = std::chrono::system_clock::now();
+        last_time_point = std::chrono::steady_clock::now();
+    }
+
+    /// Nanoseconds since an arbitrary fixed point, only differences are meaningful
+    [[maybe_unused]] static uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
     }
 
     /// Return the duration from last time point (constructor `Timer()` or `tik()`)
     [[maybe_unused]] uint64_t tik() {
-        time_point_t time_point = std::chrono::system_clock::now();
+        time_point_t time_point = std::chrono::steady_clock::now();
         auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(time_point - last_time_point);
         last_time_point = time_point;
         return duration.count();
@@ -39,6 +49,31 @@ public:
 };
 
 
+/// Seeds of the pure random number generators: `std::random_device` unless fixed by `seed`, then a deterministic sequence
+/// (per thread), so runs are reproducible
+class [[maybe_unused]] RandomSeeder {
+private:
+    static std::optional<std::mt19937> &engine() {
+        thread_local std::optional<std::mt19937> engine;
+        return engine;
+    }
+
+public:
+    [[maybe_unused]] static void seed(uint32_t seed) {
+        engine() = std::mt19937(seed);
+    }
+
+    [[maybe_unused]] static void unseed() {
+        engine().reset();
+    }
+
+    [[maybe_unused]] static uint32_t next() {
+        auto &fixed = engine();
+        return fixed ? (*fixed)() : std::random_device()();
+    }
+};
+
+
 /// A random number generator
 template <typename value_type>
 class [[maybe_unused]] Random {
@@ -54,7 +89,7 @@ public:
     [[maybe_unused]] Random(value_type min, value_type max, int seed=0, bool pure=true) {
         assert(min <= max);
         if (pure) {
-            seed = std::random_device()();
+            seed = static_cast<int> (RandomSeeder::next());
         }
         engine = std::default_random_engine(seed);
         dist = dist_t(min, max);
@@ -766,6 +801,52 @@ public:
 };
 
 
+/// A fixed-capacity FIFO queue on a ring buffer, reusable without allocations after construction
+template <typename value_type>
+class [[maybe_unused]] RingQueue {
+private:
+    std::vector<value_type> buffer;
+    size_t head = 0, count = 0;
+
+public:
+    [[maybe_unused]] explicit RingQueue(size_t capacity): buffer(capacity) {}
+
+    [[maybe_unused]] [[nodiscard]] bool empty() const {
+        return count == 0;
+    }
+
+    [[maybe_unused]] [[nodiscard]] size_t size() const {
+        return count;
+    }
+
+    [[maybe_unused]] [[nodiscard]] size_t capacity() const {
+        return buffer.size();
+    }
+
+    [[maybe_unused]] void clear() {
+        head = count = 0;
+    }
+
+    [[maybe_unused]] void push(const value_type &value) {
+        assert(count < buffer.size());
+        size_t tail = head + count;
+        buffer[tail < buffer.size() ? tail : tail - buffer.size()] = value;
+        ++ count;
+    }
+
+    [[maybe_unused]] [[nodiscard]] const value_type &front() const {
+        assert(count > 0);
+        return buffer[head];
+    }
+
+    [[maybe_unused]] void pop() {
+        assert(count > 0);
+        head = head + 1 == buffer.size() ? 0 : head + 1;
+        -- count;
+    }
+};
+
+
 /// Dynamic bitset
 class [[maybe_unused]] Bitset {
 private:
@@ -781,7 +862,7 @@ private:
         data_length += bits % width == 0 ? 0 : 1;
         assert(data_length > 0);
         assert(data == nullptr);
-        data = static_cast<data_t*> (std::malloc(data_length * width));
+        data = static_cast<data_t*> (std::malloc(data_length * sizeof(data_t)));
     }
 
 public:
@@ -794,12 +875,22 @@ public:
 
     [[maybe_unused]] Bitset(const Bitset &bitset) {
         bits = bitset.bits, data_length = bitset.data_length;
-        data = static_cast<data_t*> (std::malloc(data_length * width));
-        std::memcpy(data, bitset.data, data_length * width);
+        data = static_cast<data_t*> (std::malloc(data_length * sizeof(data_t)));
+        std::memcpy(data, bitset.data, data_length * sizeof(data_t));
+        hash_calculated = bitset.hash_calculated;
+        hash_value = bitset.hash_value;
+    }
+
+    [[maybe_unused]] Bitset(Bitset &&bitset) noexcept {
+        bits = bitset.bits, data_length = bitset.data_length;
+        data = bitset.data;
         hash_calculated = bitset.hash_calculated;
         hash_value = bitset.hash_value;
+        bitset.data = nullptr;
     }
 
+    Bitset &operator = (const Bitset &bitset) = delete;
+
     [[maybe_unused]] Bitset(int bits, const std::vector<int> &indexes): bits(bits) {
         allocate();
         clear();
@@ -809,13 +900,38 @@ public:
     }
 
     [[maybe_unused]] ~Bitset() {
-        assert(data != nullptr);
         std::free(data);
     }
 
     /// Clear all the bits
     [[maybe_unused]] void clear() {
-        std::memset(data, 0, data_length * width);
+        std::memset(data, 0, data_length * sizeof(data_t));
+        hash_calculated = false;
+    }
+
+    /// Set all the bits to `bit` (the unused tail of the last word stays 0)
+    [[maybe_unused]] void fill(bool bit) {
+        std::memset(data, bit ? 0xff : 0, data_length * sizeof(data_t));
+        if (bit and bits % width != 0) {
+            data[data_length - 1] &= (static_cast<data_t> (1) << (bits % width)) - 1;
+        }
+        hash_calculated = false;
+    }
+
+    /// Number of bits
+    [[maybe_unused]] [[nodiscard]] int size() const {
+        return bits;
+    }
+
+    /// Number of words
+    [[maybe_unused]] [[nodiscard]] int words() const {
+        return data_length;
+    }
+
+    /// The `i`-th word, holding bits [`i` * `width`, (`i` + 1) * `width`)
+    [[maybe_unused]] [[nodiscard]] data_t word(int i) const {
+        assert(i >= 0 and i < data_length);
+        return data[i];
     }
 
     /// Check whether all the bits at indexes are 1
@@ -856,4 +972,68 @@ public:
         }
         return hash_value;
     }
-};
\ No newline at end of file
+};
+
+/// Counts of non-negative values in power-of-two buckets: [0, 1), [1, 2), [2, 4), [4, 8) ...
+class [[maybe_unused]] Histogram {
+private:
+    std::vector<uint64_t> buckets;
+    uint64_t n = 0, sum = 0, min_value = UINT64_MAX, max_value = 0;
+
+    [[nodiscard]] static int bucket(uint64_t value) {
+        return value == 0 ? 0 : 64 - __builtin_clzll(value);
+    }
+
+public:
+    [[maybe_unused]] void add(uint64_t value) {
+        int i = bucket(value);
+        if (i >= buckets.size()) {
+            buckets.resize(i + 1, 0);
+        }
+        ++ buckets[i], ++ n;
+        sum += value, min_value = std::min(min_value, value), max_value = std::max(max_value, value);
+    }
+
+    [[maybe_unused]] [[nodiscard]] uint64_t count() const {
+        return n;
+    }
+
+    [[maybe_unused]] [[nodiscard]] double mean() const {
+        return n ? static_cast<double> (sum) / n : 0;
+    }
+
+    /// Upper bound of the bucket holding the `q`-quantile (clamped to the maximum)
+    [[maybe_unused]] [[nodiscard]] uint64_t quantile(double q) const {
+        uint64_t rank = static_cast<uint64_t> (q * n), seen = 0;
+        for (int i = 0; i < buckets.size(); ++ i) {
+            seen += buckets[i];
+            if (seen > rank) {
+                return std::min(i == 0 ? 0 : (static_cast<uint64_t> (1) << i) - 1, max_value);
+            }
+        }
+        return max_value;
+    }
+
+    /// A line with the count, extremes, mean and quantiles, then a bar per non-empty bucket
+    [[maybe_unused]] void print(std::ostream &out, const std::string &title, int width=40) const {
+        out << title << ": " << n << " values";
+        if (n == 0) {
+            out << std::endl;
+            return;
+        }
+        out << ", min " << min_value << ", mean " << static_cast<uint64_t> (mean()) << ", p50 <= " << quantile(0.5)
+            << ", p90 <= " << quantile(0.9) << ", max " << max_value << std::endl;
+        uint64_t highest = *std::max_element(buckets.begin(), buckets.end());
+        for (int i = 0; i < buckets.size(); ++ i) {
+            if (buckets[i] == 0) {
+                continue;
+            }
+            uint64_t low = i == 0 ? 0 : static_cast<uint64_t> (1) << (i - 1), high = static_cast<uint64_t> (1) << i;
+            std::string range = "[" + std::to_string(low) + ", " + std::to_string(high) + ")";
+            std::string count = std::to_string(buckets[i]);
+            out << "  " << range << std::string(std::max<int>(1, 26 - range.size()), ' ')
+                << count << std::string(std::max<int>(1, 10 - count.size()), ' ')
+                << std::string(std::max<uint64_t>(1, buckets[i] * width / highest), '#') << std::endl;
+        }
+    }
+};
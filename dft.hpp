@@ -10,6 +10,8 @@ struct ComplexPixel {
 
     ComplexPixel(uint8_t r_real, uint8_t g_real, uint8_t b_real): r(r_real), g(g_real), b(b_real) {}
 
+    ComplexPixel(float r_real, float g_real, float b_real): r(r_real), g(g_real), b(b_real) {}
+
     ComplexPixel(double real, double image): r(real, image), g(real, image), b(real, image) {}
 
     ComplexPixel(const std::complex<double> &r, const std::complex<double> &g, const std::complex<double> &b):
@@ -63,13 +65,31 @@ int dft_lowbit(int x) {
 }
 
 
-/// Allocate DFT working space
-void dft_alloc(const std::shared_ptr<Image> &image, int dft_w, int dft_h, ComplexPixel* &dft_space) {
+/// Allocate DFT working space (`flip` reads the image rotated by 180 degrees, as `Image::flip` does, without a copy),
+/// only the region [`x`, `x` + `w`) x [`y`, `y` + `h`) is read if given
+void dft_alloc(const std::shared_ptr<Image> &image, int dft_w, int dft_h, ComplexPixel* &dft_space, bool flip=false,
+               int x=0, int y=0, int w=-1, int h=-1) {
+    w = w == -1 ? image->w : w, h = h == -1 ? image->h : h;
+    assert(0 <= x and x + w <= image->w and 0 <= y and y + h <= image->h);
+    assert(w <= dft_w and h <= dft_h);
     dft_space = static_cast<ComplexPixel*> (std::malloc(dft_w * dft_h * sizeof(ComplexPixel)));
     std::fill(dft_space, dft_space + dft_w * dft_h, ComplexPixel());
-    for (int i = 0, index = 0; i < image->h; ++ i) {
-        for (int j = 0; j < image->w; ++ j, ++ index) {
-            dft_space[i * dft_w + j] = to_complex_pixel(image->data[index]);
+    const auto &planes = image->planes();
+    for (int i = 0; i < h; ++ i) {
+        int offset = (y + i) * image->w + x;
+        const float *r = planes.r.data() + offset;
+        const float *g = planes.g.data() + offset;
+        const float *b = planes.b.data() + offset;
+        if (flip) {
+            ComplexPixel *row = dft_space + (h - i - 1) * dft_w + w - 1;
+            for (int j = 0; j < w; ++ j) {
+                *(row - j) = ComplexPixel(r[j], g[j], b[j]);
+            }
+        } else {
+            ComplexPixel *row = dft_space + i * dft_w;
+            for (int j = 0; j < w; ++ j) {
+                row[j] = ComplexPixel(r[j], g[j], b[j]);
+            }
         }
     }
 }
@@ -77,6 +97,8 @@ void dft_alloc(const std::shared_ptr<Image> &image, int dft_w, int dft_h, Comple
 
 /// Run DFT and IDFT
 void dft(int dft_w, int dft_h, ComplexPixel* dft_space, bool inverse=false) {
+    PROFILE_PROBE(dft);
+    TraceScope trace("dft", {{"w", dft_w}, {"h", dft_h}, {"inverse", inverse}});
     // Allocate space
     double coefficient = inverse ? -1 : 1;
     assert(dft_w > 0 and dft_h > 0 and dft_w == dft_lowbit(dft_w) and dft_h == dft_lowbit(dft_h));
@@ -150,7 +172,7 @@ void dft(int dft_w, int dft_h, ComplexPixel* dft_space, bool inverse=false) {
 
 
 /// Multiply DFT result 2 into result 1
-void dft_multiply(int dft_w, int dft_h, ComplexPixel* dft_space1, ComplexPixel* dft_space2) {
+void dft_multiply(int dft_w, int dft_h, ComplexPixel* dft_space1, const ComplexPixel* dft_space2) {
     assert(dft_w > 0 and dft_h > 0 and dft_w == dft_lowbit(dft_w) and dft_h == dft_lowbit(dft_h));
     for (int i = 0; i < dft_w * dft_h; ++ i) {
         dft_space1[i] = dft_space1[i] * dft_space2[i];
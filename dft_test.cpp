@@ -1,42 +1,123 @@
+#include <cmath>
+#include <iomanip>
 #include <iostream>
+#include <vector>
 
 #include "dft.hpp"
 
 
-int main() {
-    // Set pixels
-    auto image1 = std::make_shared<Image>(3, 2);
-    auto image2 = std::make_shared<Image>(2, 5);
-    for (int y = 0; y < 2; ++ y) {
-        for (int x = 0; x < 3; ++ x) {
-            image1->set(x, y, Pixel(0, 1, 2));
+/// A random image with a fixed seed
+std::shared_ptr<Image> random_image(int w, int h, int seed) {
+    auto image = std::make_shared<Image>(w, h);
+    auto random = Random<int>(0, 255, seed, false);
+    for (int y = 0; y < h; ++ y) {
+        for (int x = 0; x < w; ++ x) {
+            image->set(x, y, Pixel(random(), random(), random()));
         }
     }
-    for (int y = 0; y < 5; ++ y) {
-        for (int x = 0; x < 2; ++ x) {
-            image2->set(x, y, Pixel(0, 1, 2));
+    return image;
+}
+
+
+/// Direct correlation of `a` against `b` shifted by (`x`, `y`), summed over the channels as `real_sum` does
+double direct_correlation(const std::shared_ptr<Image> &a, const std::shared_ptr<Image> &b, int x, int y) {
+    double sum = 0;
+    for (int j = 0; j < a->h and y + j < b->h; ++ j) {
+        for (int i = 0; i < a->w and x + i < b->w; ++ i) {
+            const auto &p = a->pixel(i, j), &q = b->pixel(x + i, y + j);
+            sum += static_cast<double> (p.r) * q.r + static_cast<double> (p.g) * q.g + static_cast<double> (p.b) * q.b;
         }
     }
+    return sum;
+}
+
 
-    // DFT
-    int dft_w = dft_round(5), dft_h = dft_round(7);
-    ComplexPixel *dft_space1, *dft_space2;
-    dft_alloc(image1, dft_w, dft_h, dft_space1);
-    dft_alloc(image2, dft_w, dft_h, dft_space2);
-    dft(dft_w, dft_h, dft_space1);
-    dft(dft_w, dft_h, dft_space2);
-    dft_multiply(dft_w, dft_h, dft_space1, dft_space2);
-    dft(dft_w, dft_h, dft_space1, true);
-
-    // Show result
-    for (int y = 0, index = 0; y < dft_h; ++ y) {
-        for (int x = 0; x < dft_w; ++ x, ++ index) {
-            std::cout << dft_space1[index].b << " ";
+int main() {
+    // Each size correlates two random images of half of it, as `Placer::fft_matching` does with the texture and the canvas
+    std::vector<std::pair<int, int>> sizes = {{8, 8}, {16, 16}, {32, 32}, {64, 16}, {64, 64}, {128, 128}, {256, 128},
+                                              {256, 256}, {512, 512}, {1024, 256}};
+    std::cout << std::setw(10) << "size" << std::setw(14) << "forward" << std::setw(14) << "multiply" << std::setw(14) << "inverse"
+              << std::setw(14) << "round trip" << std::setw(14) << "correlation" << std::setw(14) << "bound" << std::endl;
+    int failures = 0;
+    for (auto [dft_w, dft_h]: sizes) {
+        auto a = random_image(dft_w / 2, dft_h / 2, dft_w * 7 + dft_h);
+        auto b = random_image(dft_w / 2, dft_h / 2, dft_w * 11 + dft_h);
+
+        // Timing, repeated to cover at least 2^22 elements
+        int repeat = std::max(1, (1 << 22) / (dft_w * dft_h));
+        ComplexPixel *dft_space1, *dft_space2, *input;
+        dft_alloc(a, dft_w, dft_h, dft_space1, true);
+        dft_alloc(b, dft_w, dft_h, dft_space2);
+        dft_alloc(a, dft_w, dft_h, input, true);
+        uint64_t forward = 0, multiply = 0, inverse = 0;
+        double round_trip = 0;
+        for (int i = 0; i < repeat; ++ i) {
+            std::copy(input, input + dft_w * dft_h, dft_space1);
+            NanoTimer timer;
+            dft(dft_w, dft_h, dft_space1);
+            forward += timer.tik();
+            dft(dft_w, dft_h, dft_space1, true);
+            inverse += timer.tik();
         }
-        std::cout << std::endl;
+        for (int i = 0; i < dft_w * dft_h; ++ i) {
+            auto difference = dft_space1[i] - input[i];
+            round_trip = std::max({round_trip, std::abs(difference.r), std::abs(difference.g), std::abs(difference.b)});
+        }
+
+        // Correlation, the same steps as in `Placer::fft_matching`
+        dft(dft_w, dft_h, dft_space1);
+        dft(dft_w, dft_h, dft_space2);
+        ComplexPixel *product;
+        dft_alloc(a, dft_w, dft_h, product);
+        for (int i = 0; i < repeat; ++ i) {
+            std::copy(dft_space1, dft_space1 + dft_w * dft_h, product);
+            NanoTimer timer;
+            dft_multiply(dft_w, dft_h, product, dft_space2);
+            multiply += timer.tik();
+        }
+        dft(dft_w, dft_h, product, true);
+
+        // Against the direct O(n^2) correlation, over every shift for small sizes and 1000 fixed random ones otherwise
+        double error = 0;
+        auto check = [&](int x, int y) {
+            double fft = product[(a->h + y - 1) * dft_w + a->w + x - 1].real_sum();
+            error = std::max(error, std::abs(fft - direct_correlation(a, b, x, y)));
+        };
+        if (dft_w * dft_h <= 64 * 64) {
+            for (int y = 0; y < b->h; ++ y) {
+                for (int x = 0; x < b->w; ++ x) {
+                    check(x, y);
+                }
+            }
+        } else {
+            auto random_x = Random<int>(0, b->w - 1, dft_w, false), random_y = Random<int>(0, b->h - 1, dft_h, false);
+            for (int i = 0; i < 1000; ++ i) {
+                check(random_x(), random_y());
+            }
+        }
+
+        // Round-off of a radix-2 FFT grows with log(n) times the norms; the matching floors twice the correlation into
+        // an integer SSD, so the error must also stay well below 0.25
+        double norm_a = std::sqrt(direct_correlation(a, a, 0, 0)), norm_b = std::sqrt(direct_correlation(b, b, 0, 0));
+        double bound = std::min(0.25, 8 * std::log2(dft_w * dft_h) * std::numeric_limits<double>::epsilon() * norm_a * norm_b);
+        bool failed = error > bound or round_trip > 1e-9;
+        failures += failed;
+
+        std::cout << std::setw(10) << std::to_string(dft_w) + "x" + std::to_string(dft_h)
+                  << std::setw(11) << std::fixed << std::setprecision(1) << forward / 1e3 / repeat << " us"
+                  << std::setw(11) << multiply / 1e3 / repeat << " us" << std::setw(11) << inverse / 1e3 / repeat << " us"
+                  << std::setw(14) << std::scientific << std::setprecision(2) << round_trip << std::setw(14) << error
+                  << std::setw(14) << bound << (failed ? "  FAILED" : "") << std::endl;
+
+        dft_free(dft_space1);
+        dft_free(dft_space2);
+        dft_free(input);
+        dft_free(product);
     }
 
-    // Free
-    dft_free(dft_space1);
-    dft_free(dft_space2);
-}
\ No newline at end of file
+    if (failures > 0) {
+        std::cerr << failures << " sizes out of the error bounds" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -1,26 +1,50 @@
 #pragma once
 
-#include <queue>
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <vector>
 
+#include "cherry.hpp"
+#include "profiler.hpp"
 
+
+/// An arc in the residual graph, packed so a 16-bit capacity takes 10 bytes instead of 12
+#pragma pack(push, 1)
+template <typename capacity_t>
 struct Edge {
-    int v, next, capacity;
+    int v, next;
+    capacity_t capacity;
 };
+#pragma pack(pop)
+
+static_assert(sizeof(Edge<uint16_t>) == 10);
 
 
+/// Max-flow graph over a capacity type (`uint16_t`, `int32_t` or `int64_t`)
+template <typename capacity_t = int32_t>
 class Graph {
 private:
     std::vector<int> depth;
+    RingQueue<int> queue;
+
+    // A cleared bit means visited by the last `bfs_decisions`, i.e. on the source side
+    Bitset decisions;
+
+    // Minus the flow folded away by `reduce`, which every cut carries on top of the remaining graph
+    int64_t cut_offset = 0;
+
+    // Nodes contracted into the source by `reduce`, isolated from then on
+    std::vector<int> source_contracted;
 
     bool dinic_bfs(int s, int t) {
         std::fill(depth.begin(), depth.end(), 0);
         depth[s] = 1;
-        std::queue<int> queue;
+        queue.clear();
         queue.push(s);
 
-        int count = 0;
         while (not queue.empty()) {
-            ++ count;
             int u = queue.front();
             queue.pop();
             for (int i = head[u]; i != -1; i = edges[i].next) {
@@ -33,12 +57,13 @@ private:
         return depth[t] > 0;
     }
 
-    int dinic_dfs(int u, int t, int capacity) {
+    capacity_t dinic_dfs(int u, int t, capacity_t capacity) {
         if (u == t or capacity == 0) {
+            augmentations += u == t and capacity > 0;
             return capacity;
         }
 
-        int flow, total_flow = 0;
+        capacity_t flow, total_flow = 0;
         for (int i = head[u]; i != -1 and capacity > 0; i = edges[i].next) {
             if (depth[edges[i].v] == depth[u] + 1 and
                 (flow = dinic_dfs(edges[i].v, t, std::min(capacity, edges[i].capacity))) > 0) {
@@ -56,51 +81,231 @@ private:
 
     void dinic(int s, int t) {
         while (dinic_bfs(s, t)) {
+            ++ phases;
             while (dinic_dfs(s, t, inf_flow));
         }
     }
 
-    [[nodiscard]] std::vector<bool> bfs_decisions(int s) const {
-        std::vector<bool> visited(head.size(), false);
-        std::vector<bool> decisions(head.size(), true);
-        std::queue<int> queue;
+    void bfs_decisions(int s) {
+        decisions.fill(true);
+        queue.clear();
         queue.push(s);
-        visited[s] = true;
+        decisions.set_bit(s, false);
 
         while (not queue.empty()) {
             int u = queue.front();
             queue.pop();
-            decisions[u] = false;
             for (int i = head[u]; i != -1; i = edges[i].next) {
-                if (not visited[edges[i].v] and edges[i].capacity) {
-                    visited[edges[i].v] = true;
+                if (decisions.get_bit(edges[i].v) and edges[i].capacity) {
+                    decisions.set_bit(edges[i].v, false);
                     queue.push(edges[i].v);
                 }
             }
         }
-        return decisions;
     }
 
 public:
     std::vector<int> head;
-    std::vector<Edge> edges;
+    std::vector<Edge<capacity_t>> edges;
 
-    static constexpr int inf_flow = 1 << 20;
+    /// Work done by the `min_cut` calls so far: BFS phases of Dinic and augmenting paths reaching the sink
+    int phases = 0;
+    int64_t augmentations = 0;
 
-    explicit Graph(int n): head(n, -1), depth(n) {}
+    /// Half of the type range: an arc's residual never exceeds twice its capacity, so no arithmetic can overflow
+    static constexpr capacity_t inf_flow = std::numeric_limits<capacity_t>::max() / 2;
 
-    /// Add a bi-directional edge
-    void add_edge(int u, int v, int w) {
+    /// Clamp a capacity into [0, `inf_flow`], e.g. after summing infinite edges
+    [[nodiscard]] static constexpr capacity_t saturate(int64_t capacity) {
+        return static_cast<capacity_t> (std::max<int64_t>(0, std::min<int64_t>(capacity, inf_flow)));
+    }
+
+    explicit Graph(int n): head(n, -1), depth(n), queue(n), decisions(n) {}
+
+    /// Bytes held by the graph and its search buffers
+    [[nodiscard]] size_t memory() const {
+        return (head.capacity() + depth.capacity()) * sizeof(int) + edges.capacity() * sizeof(Edge<capacity_t>) +
+               queue.capacity() * sizeof(int) + decisions.words() * sizeof(uint64_t) + source_contracted.capacity() * sizeof(int);
+    }
+
+    /// Add a bi-directional edge, return its index (of the arc from `u` to `v`, the reversed one is `index ^ 1`)
+    int add_edge(int u, int v, capacity_t w) {
         assert(0 <= u and u < head.size());
         assert(0 <= v and v < head.size());
-        edges.push_back(Edge{v, head[u], w});
+        assert(0 <= w and w <= inf_flow);
+        edges.push_back(Edge<capacity_t>{v, head[u], w});
         head[u] = edges.size() - 1;
-        edges.push_back(Edge{u, head[v], w});
+        edges.push_back(Edge<capacity_t>{u, head[v], w});
         head[v] = edges.size() - 1;
+        return edges.size() - 2;
+    }
+
+    /// Flow on an edge from its first to its second end, both arcs start with the same capacity
+    [[nodiscard]] inline int64_t edge_flow(int edge) const {
+        return (static_cast<int64_t> (edges[edge ^ 1].capacity) - edges[edge].capacity) / 2;
     }
 
-    [[nodiscard]] std::vector<bool> min_cut(int s, int t) {
+    /// Total flow leaving `s` plus the flow folded away by `reduce`, i.e. the current min-cut value
+    [[nodiscard]] int64_t flow(int s) const {
+        int64_t total = 0;
+        for (int i = head[s]; i != -1; i = edges[i].next) {
+            total += edge_flow(i);
+        }
+        return total - cut_offset;
+    }
+
+    /// Shrink the graph before the first `min_cut` without changing its result: parallel edges are merged, the terminal
+    /// capacities of a node are folded into a single residual arc to the source or to the sink (the common part is flow
+    /// known in advance), and nodes whose residual exceeds all their other edges together are contracted into that terminal,
+    /// repeatedly, as such nodes are on the same side of every min-cut. Contracted nodes keep their indices but lose their
+    /// edges, edge indices are not preserved.
+    void reduce(int s, int t) {
+        int n = head.size();
+
+        // Several infinite `int64_t` edges at a node add up to more than fits, so sums saturate, and a saturated sum stays
+        // saturated: it is infinite anyway, and overstating what is left at worst prevents a contraction
+        constexpr int64_t saturated = std::numeric_limits<int64_t>::max();
+        auto add = [](int64_t a, int64_t b) {
+            return a > saturated - b ? saturated : a + b;
+        };
+        auto subtract = [](int64_t a, int64_t b) {
+            return a == saturated ? saturated : a - b;
+        };
+        struct Undirected {
+            int u, v;
+            int64_t capacity;
+        };
+
+        // Split into terminal capacities and the other edges, with no flow yet both arcs of an edge hold its capacity
+        std::vector<int64_t> source(n, 0), sink(n, 0);
+        std::vector<Undirected> links;
+        for (int i = 0; i < edges.size(); i += 2) {
+            assert(edges[i].capacity == edges[i + 1].capacity);
+            int u = edges[i + 1].v, v = edges[i].v;
+            int64_t capacity = edges[i].capacity;
+            if (u == v or capacity == 0) {
+                continue;
+            }
+            if (v == s or (v == t and u != s)) { // Terminal first
+                std::swap(u, v);
+            }
+            if (u == s and v == t) {
+                cut_offset -= capacity;
+            } else if (u == s or u == t) {
+                auto &terminal = (u == s ? source : sink)[v];
+                terminal = add(terminal, capacity);
+            } else {
+                links.push_back(Undirected{std::min(u, v), std::max(u, v), capacity});
+            }
+        }
+
+        // Merge parallel edges
+        std::sort(links.begin(), links.end(), [](const Undirected &a, const Undirected &b) {
+            return a.u != b.u ? a.u < b.u : a.v < b.v;
+        });
+        int n_links = 0;
+        for (const auto &link: links) {
+            if (n_links > 0 and links[n_links - 1].u == link.u and links[n_links - 1].v == link.v) {
+                links[n_links - 1].capacity = add(links[n_links - 1].capacity, link.capacity);
+            } else {
+                links[n_links ++] = link;
+            }
+        }
+        links.resize(n_links);
+
+        // Adjacency over the merged edges, and the capacity of the edges incident to each node
+        std::vector<int> begin(n + 1, 0), adjacent(2 * n_links);
+        std::vector<int64_t> incident(n, 0);
+        for (const auto &link: links) {
+            ++ begin[link.u + 1], ++ begin[link.v + 1];
+            incident[link.u] = add(incident[link.u], link.capacity), incident[link.v] = add(incident[link.v], link.capacity);
+        }
+        for (int u = 0; u < n; ++ u) {
+            begin[u + 1] += begin[u];
+        }
+        std::vector<int> position(begin.begin(), begin.end() - 1);
+        for (int i = 0; i < n_links; ++ i) {
+            adjacent[position[links[i].u] ++] = i;
+            adjacent[position[links[i].v] ++] = i;
+        }
+
+        // Fold, then contract while some node is hard-wired, handing its edges to its neighbors as terminal capacities
+        enum Side: int8_t { undecided, source_side, sink_side };
+        std::vector<Side> side(n, undecided);
+        side[s] = source_side, side[t] = sink_side;
+        std::vector<bool> removed(n_links, false);
+        std::vector<int> pending;
+        auto fold = [&](int u) {
+            int64_t common = std::min(source[u], sink[u]);
+            if (common == saturated) { // Infinite both ways, the flow through it is unknown: keep both arcs
+                return;
+            }
+            source[u] = subtract(source[u], common), sink[u] = subtract(sink[u], common);
+            cut_offset -= common;
+            if (source[u] > incident[u] or sink[u] > incident[u]) {
+                pending.push_back(u);
+            }
+        };
+        for (int u = 0; u < n; ++ u) {
+            if (side[u] == undecided) {
+                fold(u);
+            }
+        }
+        while (not pending.empty()) {
+            int u = pending.back();
+            pending.pop_back();
+            if (side[u] != undecided) {
+                continue;
+            }
+            side[u] = source[u] > incident[u] ? source_side : sink_side;
+            if (side[u] == source_side) {
+                source_contracted.push_back(u);
+            }
+            for (int j = begin[u]; j < begin[u + 1]; ++ j) {
+                int i = adjacent[j];
+                if (removed[i]) {
+                    continue;
+                }
+                removed[i] = true;
+                int v = links[i].u == u ? links[i].v : links[i].u;
+                auto &terminal = (side[u] == source_side ? source : sink)[v];
+                terminal = add(terminal, links[i].capacity);
+                incident[v] = subtract(incident[v], links[i].capacity);
+                fold(v);
+            }
+        }
+
+        // Rebuild with what is left
+        std::fill(head.begin(), head.end(), -1);
+        edges.clear();
+        for (int u = 0; u < n; ++ u) {
+            if (side[u] == undecided and source[u] > 0) {
+                add_edge(s, u, saturate(source[u]));
+            }
+            if (side[u] == undecided and sink[u] > 0) {
+                add_edge(u, t, saturate(sink[u]));
+            }
+        }
+        for (int i = 0; i < n_links; ++ i) {
+            if (not removed[i]) {
+                add_edge(links[i].u, links[i].v, saturate(links[i].capacity));
+            }
+        }
+    }
+
+    /// Max-flow from the current residual graph, return whether each node is on the sink side (valid until the next call)
+    [[nodiscard]] const Bitset &min_cut(int s, int t) {
+        PROFILE_PROBE(min_cut);
         dinic(s, t);
-        return bfs_decisions(s);
+        bfs_decisions(s);
+        for (int u: source_contracted) {
+            decisions.set_bit(u, false);
+        }
+        return decisions;
+    }
+
+    /// The result of the last `min_cut`, moved out of a graph that is done with, e.g. a local about to go out of scope
+    [[nodiscard]] Bitset take_decisions() && {
+        return std::move(decisions);
     }
 };
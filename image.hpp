@@ -1,13 +1,24 @@
 #pragma once
 
+#include <algorithm>
+#include <cassert>
 #include <cmath>
 #include <complex>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
 #include <vector>
 
 #include "stb/stb_image.h"
 #include "stb/stb_image_write.h"
 
+#include "cherry.hpp"
 #include "graph.hpp"
+#include "log.hpp"
+#include "profiler.hpp"
+#include "trace.hpp"
 
 
 #pragma pack()
@@ -39,15 +50,54 @@ struct Pixel {
 static_assert(sizeof(Pixel) == 3);
 
 
+/// Planar (SoA) layout of an image, one contiguous plane per channel
+struct Planes {
+    int w = 0, h = 0;
+    std::vector<float> r, g, b;
+
+    Planes(int w, int h): w(w), h(h), r(w * h), g(w * h), b(w * h) {}
+
+    inline void set(int index, const Pixel &pixel) {
+        r[index] = pixel.r, g[index] = pixel.g, b[index] = pixel.b;
+    }
+
+    /// Same as `Pixel::sqr_sum`, exact since every channel square sum fits into a float mantissa
+    [[nodiscard]] inline uint64_t sqr_sum(int index) const {
+        return static_cast<uint64_t> (r[index] * r[index] + g[index] * g[index] + b[index] * b[index]);
+    }
+};
+
+
+/// Gradient magnitude planes of an image along x and y (central colour differences, clamped at the borders)
+struct Gradients {
+    int w = 0, h = 0;
+    std::vector<float> x, y;
+
+    Gradients(int w, int h): w(w), h(h), x(w * h), y(w * h) {}
+};
+
+
+// See matching.hpp
+struct MatchingData;
+
+
 class Image {
 private:
     bool from_stbi;
+    mutable std::shared_ptr<Planes> planes_cache;
+    mutable std::shared_ptr<Gradients> gradients_cache;
+
+    Image() = default;
 
 public:
     int w = 0, h = 0;
     Pixel *data = nullptr;
 
+    /// The texture side of the FFT matching, built on first use by `MatchingData::of`
+    mutable std::shared_ptr<MatchingData> matching_cache;
+
     explicit Image(const std::string &path) {
+        PROFILE_PROBE(read_image);
         from_stbi = true;
         int c;
         data = reinterpret_cast<Pixel*> (stbi_load(path.c_str(), &w, &h, &c, 3));
@@ -57,6 +107,20 @@ public:
         }
     }
 
+    /// Decode an image file held in memory (any format `stbi_load` reads), `nullptr` if it is not one
+    [[nodiscard]] static std::shared_ptr<Image> decode(const uint8_t *bytes, size_t size) {
+        PROFILE_PROBE(read_image);
+        int w, h, c;
+        auto *data = stbi_load_from_memory(bytes, static_cast<int> (size), &w, &h, &c, 3);
+        if (not data) {
+            return nullptr;
+        }
+        auto image = std::shared_ptr<Image>(new Image());
+        image->from_stbi = true;
+        image->w = w, image->h = h, image->data = reinterpret_cast<Pixel*> (data);
+        return image;
+    }
+
     Image(int w, int h): w(w), h(h) {
         from_stbi = false;
         data = static_cast<Pixel*> (std::malloc(w * h * sizeof(Pixel)));
@@ -87,18 +151,87 @@ public:
         return var / (w * h);
     }
 
-    void write(const std::string &path) const {
+    /// Write as PNG, return false on failure
+    [[nodiscard]] bool save(const std::string &path) const {
+        PROFILE_PROBE(write_image);
         assert(data);
-        if (not stbi_write_png(path.c_str(), w, h, 3, reinterpret_cast<uint8_t*>(data), 0)) {
+        return stbi_write_png(path.c_str(), w, h, 3, reinterpret_cast<uint8_t*>(data), 0);
+    }
+
+    /// The same, exit on failure
+    void write(const std::string &path) const {
+        if (not save(path)) {
             std::cerr << "Unable to write image to " << path << std::endl;
             std::exit(EXIT_FAILURE);
         }
     }
 
+    /// PNG file contents of the image
+    [[nodiscard]] std::vector<uint8_t> encode_png() const {
+        PROFILE_PROBE(write_image);
+        assert(data);
+        std::vector<uint8_t> bytes;
+        auto append = [](void *context, void *chunk, int size) {
+            auto *bytes = static_cast<std::vector<uint8_t>*> (context);
+            bytes->insert(bytes->end(), static_cast<uint8_t*> (chunk), static_cast<uint8_t*> (chunk) + size);
+        };
+        stbi_write_png_to_func(append, &bytes, w, h, 3, reinterpret_cast<uint8_t*>(data), 0);
+        return bytes;
+    }
+
     inline void set(int x, int y, const Pixel &pixel) const {
         assert(0 <= x and x < w);
         assert(0 <= y and y < h);
-        data[y * w + x] = pixel;
+        set(y * w + x, pixel);
+    }
+
+    inline void set(int index, const Pixel &pixel) const {
+        data[index] = pixel;
+        if (planes_cache) {
+            planes_cache->set(index, pixel);
+        }
+    }
+
+    /// Planar view of the pixels, built on first use and kept in sync by `set`
+    [[nodiscard]] const Planes &planes() const {
+        if (not planes_cache) {
+            planes_cache = std::make_shared<Planes>(w, h);
+            for (int i = 0; i < w * h; ++ i) {
+                planes_cache->set(i, data[i]);
+            }
+        }
+        return *planes_cache;
+    }
+
+    /// Gradient magnitudes, built on first use
+    [[nodiscard]] const Gradients &gradients() const {
+        if (not gradients_cache) {
+            gradients_cache = std::make_shared<Gradients>(w, h);
+            update_gradients(0, 0, w, h);
+        }
+        return *gradients_cache;
+    }
+
+    /// Refresh the gradient magnitudes after the pixels in a box changed (no-op if they were never used)
+    void update_gradients(int x_begin, int y_begin, int x_end, int y_end) const {
+        if (not gradients_cache) {
+            return;
+        }
+        const auto &p = planes();
+        auto distance = [&p](int i, int j) {
+            float r_d = p.r[i] - p.r[j], g_d = p.g[i] - p.g[j], b_d = p.b[i] - p.b[j];
+            return std::sqrt(r_d * r_d + g_d * g_d + b_d * b_d) * 0.5f;
+        };
+        x_begin = std::max(x_begin - 1, 0), y_begin = std::max(y_begin - 1, 0);
+        x_end = std::min(x_end + 1, w), y_end = std::min(y_end + 1, h);
+        for (int y = y_begin; y < y_end; ++ y) {
+            for (int x = x_begin, index = y * w + x_begin; x < x_end; ++ x, ++ index) {
+                int left = y * w + std::max(x - 1, 0), right = y * w + std::min(x + 1, w - 1);
+                int up = std::max(y - 1, 0) * w + x, down = std::min(y + 1, h - 1) * w + x;
+                gradients_cache->x[index] = distance(left, right);
+                gradients_cache->y[index] = distance(up, down);
+            }
+        }
     }
 
     [[nodiscard]] inline Pixel pixel(int x, int y) const {
@@ -107,6 +240,32 @@ public:
         return data[y * w + x];
     }
 
+    [[nodiscard]] std::shared_ptr<Image> copy() const {
+        auto copied = std::make_shared<Image>(w, h);
+        std::memcpy(copied->data, data, w * h * sizeof(Pixel));
+        return copied;
+    }
+
+    /// Shrink by an integer factor with a box filter (a trailing partial block is dropped)
+    [[nodiscard]] std::shared_ptr<Image> downsample(int factor) const {
+        assert(factor >= 1 and w >= factor and h >= factor);
+        auto small = std::make_shared<Image>(w / factor, h / factor);
+        for (int y = 0; y < small->h; ++ y) {
+            for (int x = 0; x < small->w; ++ x) {
+                int r = 0, g = 0, b = 0;
+                for (int j = 0; j < factor; ++ j) {
+                    for (int i = 0; i < factor; ++ i) {
+                        auto p = pixel(x * factor + i, y * factor + j);
+                        r += p.r, g += p.g, b += p.b;
+                    }
+                }
+                int n = factor * factor;
+                small->set(x, y, Pixel(r / n, g / n, b / n));
+            }
+        }
+        return small;
+    }
+
     [[nodiscard]] std::shared_ptr<Image> flip() const {
         auto flipped = std::make_shared<Image>(w, h);
         for (int y = 0, index = 0; y < h; ++ y) {
@@ -124,6 +283,9 @@ public:
     int x, y;
     std::shared_ptr<Image> image;
 
+    // The sequence number assigned by `Canvas::apply`, -1 if never applied
+    int order = -1;
+
     Patch(const std::shared_ptr<Image> &image, int x, int y): x(x), y(y), image(image) {}
 
     [[nodiscard]] inline int x_end() const {
@@ -144,53 +306,233 @@ public:
 };
 
 
+/// Seam cost M(s, t, A, B) of the paper, using the plain colour difference
+struct PlainSeamCost {
+    static constexpr bool gradient_based = false;
+
+    /// Matching cost ||A(s) - B(s)|| of a single pixel
+    [[nodiscard]] static inline int pixel(float a_r, float a_g, float a_b, float b_r, float b_g, float b_b) {
+        float r_d = a_r - b_r, g_d = a_g - b_g, b_d = a_b - b_b;
+        // Exact integers in float, so truncating the root gives the same value as `Pixel::distance`
+        return static_cast<int> (std::sqrt(r_d * r_d + g_d * g_d + b_d * b_d));
+    }
+
+    [[nodiscard]] static inline int pixel(const Pixel &a, const Pixel &b) {
+        return pixel(a.r, a.g, a.b, b.r, b.g, b.b);
+    }
+
+    /// Edge capacity from the matching costs of s and t, and the sum of the gradient magnitudes of A and B at s and t
+    [[nodiscard]] static inline int edge(int m_s, int m_t, [[maybe_unused]] float gradients) {
+        return m_s + m_t;
+    }
+};
+
+
+/// Seam cost divided by the gradient magnitudes along the edge, so seams hide in high-frequency regions
+struct GradientSeamCost: PlainSeamCost {
+    static constexpr bool gradient_based = true;
+
+    /// The gradient sum at which the capacity is halved
+    static constexpr float normalizer = 32;
+
+    [[nodiscard]] static inline int edge(int m_s, int m_t, float gradients) {
+        return static_cast<int> (std::lround((m_s + m_t) * normalizer / (normalizer + gradients)));
+    }
+};
+
+
+/// Seam cost using the "redmean" colour distance, which weights channels closer to human perception
+struct PerceptualSeamCost: PlainSeamCost {
+    [[nodiscard]] static inline int pixel(float a_r, float a_g, float a_b, float b_r, float b_g, float b_b) {
+        float r_mean = (a_r + b_r) * 0.5f;
+        float r_d = a_r - b_r, g_d = a_g - b_g, b_d = a_b - b_b;
+        float sqr = (2 + r_mean / 256) * r_d * r_d + 4 * g_d * g_d + (2 + (255 - r_mean) / 256) * b_d * b_d;
+        // The weights sum to 9 against 3 of the plain distance, scale back to the same range
+        return static_cast<int> (std::sqrt(sqr / 3));
+    }
+
+    [[nodiscard]] static inline int pixel(const Pixel &a, const Pixel &b) {
+        return pixel(a.r, a.g, a.b, b.r, b.g, b.b);
+    }
+};
+
+
+enum class SeamCostKind {
+    plain, gradient, perceptual
+};
+
+
+/// An edge of a seam graph before the capacity type is chosen
+struct SeamEdge {
+    static constexpr int inf = -1;
+
+    int u, v, capacity;
+};
+
+
+/// Whether a patch applied on a full canvas is kept: a cut raising the total seam cost by `delta` is rolled back,
+/// unless `temperature` is positive and it passes the annealing test with possibility exp(-delta / temperature)
+struct Acceptance {
+    bool rollback = false;
+    double temperature = 0;
+};
+
+
+/// The seam graph of one `Canvas::apply` and the work of its max-flow
+struct ApplyStats {
+    int x = 0, y = 0;
+    int overlapped = 0, old_seam_nodes = 0, nodes = 0, edges = 0, changed = 0;
+    int64_t flow = 0;
+    int phases = 0;
+    int64_t augmentations = 0;
+    uint64_t nanoseconds = 0, build_nanoseconds = 0, max_flow_nanoseconds = 0; // Building includes `Graph::reduce`
+    bool rolled_back = false;
+};
+
+
 class Canvas: public Image {
 private:
     std::vector<std::shared_ptr<Patch>> origin;
 
-public:
-    Canvas(int w, int h): Image(w, h), origin(w * h) {}
+    // One per `apply`, in order
+    std::vector<ApplyStats> stats;
 
-    [[nodiscard]] bool none_empty() const {
-        for (int i = 0; i < w * h; ++ i) {
-            if (not origin[i]) {
-                return false;
-            }
+    // Costs of the seams between a pixel and its right (`seam_x`) or lower (`seam_y`) neighbor, -1 for no seam
+    std::vector<int> seam_x, seam_y;
+    uint64_t seam_sum = 0;
+
+    int applied = 0, n_filled = 0, rejected = 0;
+
+    /// Apply the patch, and with rollback enabled on a full canvas, restore the touched box if the seams got worse
+    template <typename Cost>
+    int commit(const std::shared_ptr<Patch> &patch) {
+        if (not acceptance.rollback or n_filled < w * h) {
+            return apply_with<Cost>(patch);
         }
-        return true;
-    }
 
-    [[nodiscard]] inline bool in_range(int x, int y) const {
-        return 0 <= x and x < w and 0 <= y and y < h;
+        // Save the box, everything else (planes, gradients and seams) derives from pixels and origins
+        int x_begin = std::max(patch->x, 0), x_end = std::min(patch->x_end(), w);
+        int y_begin = std::max(patch->y, 0), y_end = std::min(patch->y_end(), h);
+        int box_w = x_end - x_begin;
+        std::vector<Pixel> saved_pixels;
+        std::vector<std::shared_ptr<Patch>> saved_origin;
+        saved_pixels.reserve(box_w * (y_end - y_begin)), saved_origin.reserve(box_w * (y_end - y_begin));
+        for (int y = y_begin; y < y_end; ++ y) {
+            saved_pixels.insert(saved_pixels.end(), data + y * w + x_begin, data + y * w + x_end);
+            saved_origin.insert(saved_origin.end(), origin.begin() + y * w + x_begin, origin.begin() + y * w + x_end);
+        }
+
+        uint64_t before = seam_sum;
+        int changed = apply_with<Cost>(patch);
+        if (seam_sum <= before) {
+            return changed;
+        }
+        double delta = static_cast<double> (seam_sum - before);
+        if (acceptance.temperature > 0 and Random<double>(0, 1)() < std::exp(-delta / acceptance.temperature)) {
+            return changed;
+        }
+
+        // Roll back
+        for (int y = y_begin, i = 0; y < y_end; ++ y) {
+            for (int x = x_begin; x < x_end; ++ x, ++ i) {
+                set(y * w + x, saved_pixels[i]);
+                origin[y * w + x] = saved_origin[i];
+            }
+        }
+        update_gradients(x_begin, y_begin, x_end, y_end);
+        update_seams<Cost>(x_begin, y_begin, x_end, y_end);
+        assert(seam_sum == before);
+        ++ rejected;
+        return 0;
     }
 
-    [[nodiscard]] uint64_t ssd(const std::shared_ptr<Patch> &patch, int canvas_x=-1, int canvas_y=-1, int sub_patch_w=-1, int sub_patch_h=-1) const {
-        int x_begin = std::max(patch->x, 0);
-        int y_begin = std::max(patch->y, 0);
-        int x_end = std::min(patch->x_end(), w);
-        int y_end = std::min(patch->y_end(), h);
-        if (canvas_x != -1 and canvas_y != -1 and sub_patch_w != -1 and sub_patch_h != -1) {
-            x_begin = canvas_x, y_begin = canvas_y;
-            x_end = std::min(x_end, x_begin + sub_patch_w), y_end = std::min(y_end, y_begin + sub_patch_h);
+    /// Cost of the seam between (x, y) and (a, b) from their origins, -1 if they are not two patches covering both pixels
+    template <typename Cost>
+    [[nodiscard]] int seam_cost_between(int x, int y, int a, int b, int d) const {
+        if (not in_range(a, b)) {
+            return -1;
+        }
+        const auto &origin_s = origin[y * w + x], &origin_t = origin[b * w + a];
+        if (not origin_s or not origin_t or origin_s == origin_t or
+            not origin_s->in_range(a, b) or not origin_t->in_range(x, y)) {
+            return -1;
         }
+        int m_s = Cost::pixel(origin_s->pixel(x, y), origin_t->pixel(x, y));
+        int m_t = Cost::pixel(origin_s->pixel(a, b), origin_t->pixel(a, b));
+        float gradients = 0;
+        if constexpr (Cost::gradient_based) {
+            gradients = patch_gradient(origin_s, x, y, d) + patch_gradient(origin_s, a, b, d) +
+                        patch_gradient(origin_t, x, y, d) + patch_gradient(origin_t, a, b, d);
+        }
+        return Cost::edge(m_s, m_t, gradients);
+    }
 
-        int overlapped = 0;
-        uint64_t ssd = 0;
+    /// Recompute the seam costs touching a box whose origins changed
+    template <typename Cost>
+    void update_seams(int x_begin, int y_begin, int x_end, int y_end) {
+        auto update = [this](int &cost, int new_cost) {
+            seam_sum -= cost >= 0 ? cost : 0;
+            cost = new_cost;
+            seam_sum += cost >= 0 ? cost : 0;
+        };
+        x_begin = std::max(x_begin - 1, 0), y_begin = std::max(y_begin - 1, 0);
         for (int y = y_begin; y < y_end; ++ y) {
-            for (int x = x_begin; x < x_end; ++ x) {
-                int index = y * w + x;
-                if (origin[index]) {
-                    ssd += data[index].sqr_distance(patch->pixel(x, y));
-                    ++ overlapped;
-                }
+            for (int x = x_begin, index = y * w + x_begin; x < x_end; ++ x, ++ index) {
+                update(seam_y[index], seam_cost_between<Cost>(x, y, x, y + 1, 0));
+                update(seam_x[index], seam_cost_between<Cost>(x, y, x + 1, y, 1));
             }
         }
-        assert(overlapped > 0);
-        return ssd / overlapped;
     }
 
-    void apply(const std::shared_ptr<Patch> &patch) {
-        std::cout << " > Applying a new patch at (" << patch->x << ", " << patch->y << ")" << std::endl;
+    /// Write a seam graph in the DIMACS max-flow format (1-based nodes), each edge as two opposite arcs of the same capacity
+    /// and the infinite ones as the value in the `c infinity` line, which exceeds all finite capacities together
+    static void dump_graph(const std::string &path, int n, const std::vector<SeamEdge> &edges, int s, int t, int64_t finite_capacity) {
+        std::ofstream file(path);
+        if (not file) {
+            std::cerr << "Failed to dump graph into " << path << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        file << "c seam graph, undirected edges as opposite arc pairs" << '\n';
+        file << "c infinity " << finite_capacity + 1 << '\n';
+        file << "p max " << n << " " << edges.size() * 2 << '\n';
+        file << "n " << s + 1 << " s" << '\n';
+        file << "n " << t + 1 << " t" << '\n';
+        for (const auto &edge: edges) {
+            int64_t capacity = edge.capacity == SeamEdge::inf ? finite_capacity + 1 : edge.capacity;
+            file << "a " << edge.u + 1 << " " << edge.v + 1 << " " << capacity << '\n';
+            file << "a " << edge.v + 1 << " " << edge.u + 1 << " " << capacity << '\n';
+        }
+    }
+
+    /// Solve a seam graph with the given capacity type, recording the flow, the solver work and the times of building (and
+    /// reducing) the graph and of the max-flow alone into `apply_stats`
+    template <typename capacity_t>
+    [[nodiscard]] static Bitset min_cut(int n, const std::vector<SeamEdge> &edges, int s, int t, ApplyStats &apply_stats) {
+        NanoTimer timer;
+        Graph<capacity_t> graph(n);
+        graph.edges.reserve(edges.size() * 2);
+        for (const auto &edge: edges) {
+            graph.add_edge(edge.u, edge.v, edge.capacity == SeamEdge::inf ? Graph<capacity_t>::inf_flow : edge.capacity);
+        }
+        graph.reduce(s, t);
+        apply_stats.build_nanoseconds = timer.tik();
+        static_cast<void> (graph.min_cut(s, t));
+        apply_stats.max_flow_nanoseconds = timer.tik();
+        apply_stats.flow = graph.flow(s);
+        apply_stats.phases = graph.phases, apply_stats.augmentations = graph.augmentations;
+        return std::move(graph).take_decisions();
+    }
+
+    /// Gradient magnitude of a patch at canvas position (x, y), along y for `d` = 0 and along x for `d` = 1
+    [[nodiscard]] static inline float patch_gradient(const std::shared_ptr<Patch> &patch, int x, int y, int d) {
+        const auto &gradients = patch->image->gradients();
+        int index = (y - patch->y) * patch->image->w + x - patch->x;
+        return d == 0 ? gradients.y[index] : gradients.x[index];
+    }
+
+    template <typename Cost>
+    int apply_with(const std::shared_ptr<Patch> &patch) {
+        patch->order = applied ++;
         int x_begin = std::max(patch->x, 0);
         int y_begin = std::max(patch->y, 0);
         int x_end = std::min(patch->x_end(), w);
@@ -199,7 +541,7 @@ public:
         // Fill non-overlapped area first
         static int dx[4] = { 0, +1,  0, -1};
         static int dy[4] = {+1,  0, -1,  0};
-        int n_old_seam_nodes = 0;
+        int n_old_seam_nodes = 0, changed = 0;
         std::vector<std::pair<int, int>> overlapped;
         std::vector<int> overlapped_index(w * h, -1);
         for (int y = y_begin; y < y_end; ++ y) {
@@ -207,7 +549,8 @@ public:
                 int index = y * w + x;
                 if (not origin[index]) {
                     origin[index] = patch;
-                    data[index] = patch->pixel(x, y);
+                    set(index, patch->pixel(x, y));
+                    ++ changed, ++ n_filled;
                 } else {
                     assert(origin[index] != patch);
                     overlapped_index[index] = overlapped.size();
@@ -223,55 +566,301 @@ public:
             }
         }
 
-        // Build graph
-        Graph graph(overlapped.size() + n_old_seam_nodes + 2);
+        // Matching costs of the overlapped box
+        PROFILE_ENTER(graph_build);
+        PROFILE_BEGIN(graph_build);
+        int box_w = x_end - x_begin, box_h = y_end - y_begin;
+        std::vector<int> costs(box_w * box_h);
+        matching_costs<Cost>(patch, x_begin, y_begin, x_end, y_end, costs.data());
+        auto cost = [&costs, x_begin, y_begin, box_w](int x, int y) {
+            return costs[(y - y_begin) * box_w + x - x_begin];
+        };
+
+        // Sum of the gradient magnitudes of the canvas and the patch at both ends of the edge
+        auto gradients = [this, &patch](int x, int y, int a, int b, int d) -> float {
+            if constexpr (Cost::gradient_based) {
+                const auto &canvas_gradients = d == 0 ? this->gradients().y : this->gradients().x;
+                return canvas_gradients[y * w + x] + canvas_gradients[b * w + a] +
+                       patch_gradient(patch, x, y, d) + patch_gradient(patch, a, b, d);
+            }
+            return 0;
+        };
+
+        // Build graph, collecting the edges first to pick the capacity type
+        int n = overlapped.size() + n_old_seam_nodes + 2;
         int s = overlapped.size() + n_old_seam_nodes, t = overlapped.size() + n_old_seam_nodes + 1;
         int old_sean_node_index = overlapped.size();
+        std::vector<SeamEdge> graph;
+        int64_t finite_capacity = 0;
+        auto add_edge = [&graph, &finite_capacity](int u, int v, int capacity) {
+            graph.push_back(SeamEdge{u, v, capacity});
+            finite_capacity += std::max(capacity, 0);
+        };
         for (int i = 0; i < overlapped.size(); ++ i) {
             auto [x, y] = overlapped[i];
             int index = y * w + x;
-            int m_s = pixel(x, y).distance(patch->pixel(x, y));
+            int m_s = cost(x, y);
             for (int d = 0; d < 4; ++ d) {
                 int a = x + dx[d], b = y + dy[d];
                 int neighbor_index = b * w + a;
                 if (in_range(a, b) and origin[neighbor_index]) {
                     if (origin[neighbor_index] == patch) {
-                        graph.add_edge(i, t, Graph::inf_flow);
+                        add_edge(i, t, SeamEdge::inf);
                     } else {
                         if (overlapped_index[neighbor_index] == -1) {
-                            graph.add_edge(s, i, Graph::inf_flow);
+                            add_edge(s, i, SeamEdge::inf);
                         } else if (d < 2) { // `add_edge` is bi-directional
-                            if (origin[index] != origin[neighbor_index] and origin[index]->in_range(a, b) and
-                                origin[neighbor_index]->in_range(a, b)) { // Old seam node
-                                int m_t = data[neighbor_index].distance(patch->pixel(a, b));
-                                graph.add_edge(old_sean_node_index, i, m_s + m_t);
-                                graph.add_edge(old_sean_node_index, overlapped_index[neighbor_index], m_s + m_t);
-                                int old_m_s = origin[index]->pixel(x, y).distance(origin[neighbor_index]->pixel(x, y));
-                                int old_m_t = origin[index]->pixel(a, b).distance(origin[neighbor_index]->pixel(a, b));
-                                graph.add_edge(old_sean_node_index, t, old_m_s + old_m_t);
+                            int m_t = cost(a, b), capacity = Cost::edge(m_s, m_t, gradients(x, y, a, b, d));
+                            int old_seam = d == 0 ? seam_y[index] : seam_x[index];
+                            if (old_seam >= 0) { // Old seam node
+                                add_edge(old_sean_node_index, i, capacity);
+                                add_edge(old_sean_node_index, overlapped_index[neighbor_index], capacity);
+                                add_edge(old_sean_node_index, t, old_seam);
                                 ++ old_sean_node_index;
                             } else {
-                                int m_t = data[neighbor_index].distance(patch->pixel(a, b));
-                                graph.add_edge(i, overlapped_index[neighbor_index], m_s + m_t);
+                                add_edge(i, overlapped_index[neighbor_index], capacity);
                             }
                         }
                     }
                 }
             }
         }
-        // std::cout << " > " << overlapped.size() << " overlapped pixels" << std::endl;
+        auto &apply_stats = stats.back();
+        apply_stats.overlapped = overlapped.size(), apply_stats.old_seam_nodes = n_old_seam_nodes;
+        apply_stats.nodes = n, apply_stats.edges = graph.size();
 
         // Min-cut and overwrite
-        // std::cout << " > Running min-cut algorithm ... " << std::endl;
-        auto decisions = graph.min_cut(s, t);
-        assert(decisions.size() == overlapped.size() + n_old_seam_nodes + 2);
-        for (int i = 0; i < overlapped.size(); ++ i) {
-            if (decisions[i]) { // Belongs to the new patch
+        if (not graph_dump_prefix.empty()) {
+            dump_graph(graph_dump_prefix + std::to_string(patch->order) + ".max", n, graph, s, t, finite_capacity);
+        }
+        PROFILE_COUNT(overlapped_pixels, overlapped.size());
+        TraceScope::annotate("overlapped", overlapped.size());
+        PROFILE_COUNT(graph_nodes, n);
+        PROFILE_COUNT(graph_edges, graph.size());
+        PROFILE_END(graph_build);
+        PROFILE_LEAVE();
+        // The smallest type whose infinity exceeds all finite capacities together, so infinite edges are never cut by choice
+        auto decisions = [&]() {
+            PROFILE_PHASE(max_flow);
+            if (finite_capacity < Graph<uint16_t>::inf_flow) {
+                return min_cut<uint16_t>(n, graph, s, t, stats.back());
+            } else if (finite_capacity < Graph<int32_t>::inf_flow) {
+                return min_cut<int32_t>(n, graph, s, t, stats.back());
+            }
+            return min_cut<int64_t>(n, graph, s, t, stats.back());
+        }();
+        assert(decisions.size() == n);
+
+        // A word at a time, only visiting the bits set (belonging to the new patch)
+        for (int word_index = 0; word_index * Bitset::width < overlapped.size(); ++ word_index) {
+            for (uint64_t word = decisions.word(word_index); word; word &= word - 1) {
+                int i = word_index * Bitset::width + __builtin_ctzll(word);
+                if (i >= overlapped.size()) {
+                    break;
+                }
                 auto [x, y] = overlapped[i];
                 int index = y * w + x;
                 origin[index] = patch;
-                data[index] = patch->pixel(x, y);
+                set(index, patch->pixel(x, y));
+                ++ changed;
+            }
+        }
+        update_gradients(x_begin, y_begin, x_end, y_end);
+        update_seams<Cost>(x_begin, y_begin, x_end, y_end);
+        return changed;
+    }
+
+public:
+    SeamCostKind seam_cost = SeamCostKind::plain;
+    Acceptance acceptance;
+
+    /// If not empty, every seam graph is dumped into `<prefix><patch order>.max` before its cut
+    std::string graph_dump_prefix;
+
+    Canvas(int w, int h): Image(w, h), origin(w * h), seam_x(w * h, -1), seam_y(w * h, -1) {
+        // Keep the planar view alive from the start, so `set` maintains it for the matching and seam costs
+        std::fill(data, data + w * h, Pixel(0, 0, 0));
+        static_cast<void> (planes());
+    }
+
+    /// Per-pixel matching cost ||A(s) - B(s)|| of the canvas against `patch` over a box, in one pass over the planes
+    template <typename Cost>
+    void matching_costs(const std::shared_ptr<Patch> &patch, int x_begin, int y_begin, int x_end, int y_end, int *costs) const {
+        const auto &canvas_planes = planes();
+        const auto &patch_planes = patch->image->planes();
+        int box_w = x_end - x_begin;
+        for (int y = y_begin; y < y_end; ++ y) {
+            int offset_a = y * w + x_begin, offset_b = (y - patch->y) * patch->image->w + x_begin - patch->x;
+            const float *a_r = canvas_planes.r.data() + offset_a, *b_r = patch_planes.r.data() + offset_b;
+            const float *a_g = canvas_planes.g.data() + offset_a, *b_g = patch_planes.g.data() + offset_b;
+            const float *a_b = canvas_planes.b.data() + offset_a, *b_b = patch_planes.b.data() + offset_b;
+            int *row = costs + (y - y_begin) * box_w;
+            for (int x = 0; x < box_w; ++ x) {
+                row[x] = Cost::pixel(a_r[x], a_g[x], a_b[x], b_r[x], b_g[x], b_b[x]);
+            }
+        }
+    }
+
+    /// Cost of the seam between (x, y) and its right neighbor, -1 for no seam
+    [[nodiscard]] inline int seam_right(int x, int y) const {
+        return seam_x[y * w + x];
+    }
+
+    /// Cost of the seam between (x, y) and its lower neighbor, -1 for no seam
+    [[nodiscard]] inline int seam_down(int x, int y) const {
+        return seam_y[y * w + x];
+    }
+
+    /// Sum of all the seam costs on the canvas
+    [[nodiscard]] inline uint64_t total_seam_cost() const {
+        return seam_sum;
+    }
+
+    /// The canvas with seams drawn in red, brighter for higher costs
+    [[nodiscard]] std::shared_ptr<Image> seam_visualization() const {
+        int max_cost = 1;
+        for (int i = 0; i < w * h; ++ i) {
+            max_cost = std::max({max_cost, seam_x[i], seam_y[i]});
+        }
+        auto image = std::make_shared<Image>(w, h);
+        for (int i = 0; i < w * h; ++ i) {
+            int cost = std::max(seam_x[i], seam_y[i]);
+            if (cost >= 0) {
+                image->set(i, Pixel(128 + 127 * cost / max_cost, 0, 0));
+            } else {
+                image->set(i, Pixel(data[i].r / 2, data[i].g / 2, data[i].b / 2));
+            }
+        }
+        return image;
+    }
+
+    /// The patches still owning some pixels, in the order they were applied
+    [[nodiscard]] std::vector<std::shared_ptr<Patch>> patches() const {
+        std::vector<std::shared_ptr<Patch>> visible;
+        for (int i = 0; i < w * h; ++ i) {
+            if (origin[i] and (i == 0 or origin[i] != origin[i - 1])) {
+                visible.push_back(origin[i]);
+            }
+        }
+        std::sort(visible.begin(), visible.end(), [](const auto &a, const auto &b) {
+            return a->order < b->order;
+        });
+        visible.erase(std::unique(visible.begin(), visible.end()), visible.end());
+        return visible;
+    }
+
+    /// Whether a pixel is covered
+    [[nodiscard]] inline bool filled(int x, int y) const {
+        return static_cast<bool> (origin[y * w + x]);
+    }
+
+    [[nodiscard]] bool none_empty() const {
+        return n_filled == w * h;
+    }
+
+    [[nodiscard]] int filled_pixels() const {
+        return n_filled;
+    }
+
+    /// Number of patches rolled back by the acceptance test
+    [[nodiscard]] inline int rejections() const {
+        return rejected;
+    }
+
+    [[nodiscard]] inline bool in_range(int x, int y) const {
+        return 0 <= x and x < w and 0 <= y and y < h;
+    }
+
+    [[nodiscard]] uint64_t ssd(const std::shared_ptr<Patch> &patch, int canvas_x=-1, int canvas_y=-1, int sub_patch_w=-1, int sub_patch_h=-1) const {
+        int x_begin = std::max(patch->x, 0);
+        int y_begin = std::max(patch->y, 0);
+        int x_end = std::min(patch->x_end(), w);
+        int y_end = std::min(patch->y_end(), h);
+        if (canvas_x != -1 and canvas_y != -1 and sub_patch_w != -1 and sub_patch_h != -1) {
+            x_begin = canvas_x, y_begin = canvas_y;
+            x_end = std::min(x_end, x_begin + sub_patch_w), y_end = std::min(y_end, y_begin + sub_patch_h);
+        }
+
+        int overlapped = 0;
+        uint64_t ssd = 0;
+        for (int y = y_begin; y < y_end; ++ y) {
+            for (int x = x_begin; x < x_end; ++ x) {
+                int index = y * w + x;
+                if (origin[index]) {
+                    ssd += data[index].sqr_distance(patch->pixel(x, y));
+                    ++ overlapped;
+                }
+            }
+        }
+        assert(overlapped > 0);
+        return ssd / overlapped;
+    }
+
+    /// Statistics of every `apply` so far, in order
+    [[nodiscard]] const std::vector<ApplyStats> &apply_stats() const {
+        return stats;
+    }
+
+    /// Histograms of the seam graph sizes, flows, solver work and times (in microseconds) of the applies with an overlap
+    void print_apply_stats(std::ostream &out) const {
+        Histogram overlapped, old_seam_nodes, edges, flow, phases, augmentations, microseconds, build_microseconds,
+                  max_flow_microseconds;
+        int rolled_back = 0;
+        for (const auto &apply_stats: stats) {
+            if (apply_stats.overlapped == 0) {
+                continue;
+            }
+            overlapped.add(apply_stats.overlapped), old_seam_nodes.add(apply_stats.old_seam_nodes);
+            edges.add(apply_stats.edges), flow.add(std::max<int64_t>(apply_stats.flow, 0));
+            phases.add(apply_stats.phases), augmentations.add(apply_stats.augmentations);
+            microseconds.add(apply_stats.nanoseconds / 1000), build_microseconds.add(apply_stats.build_nanoseconds / 1000);
+            max_flow_microseconds.add(apply_stats.max_flow_nanoseconds / 1000);
+            rolled_back += apply_stats.rolled_back;
+        }
+        out << stats.size() << " applies, " << overlapped.count() << " with an overlap, " << rolled_back << " rolled back" << std::endl;
+        overlapped.print(out, "overlapped pixels");
+        old_seam_nodes.print(out, "old seam nodes");
+        edges.print(out, "edges");
+        flow.print(out, "flow");
+        phases.print(out, "BFS phases");
+        augmentations.print(out, "augmenting paths");
+        microseconds.print(out, "apply time (us)");
+        build_microseconds.print(out, "graph build and reduce time (us)");
+        max_flow_microseconds.print(out, "max-flow time (us)");
+    }
+
+    /// The same, one CSV row per `apply`
+    void write_apply_stats(std::ostream &out) const {
+        out << "x,y,overlapped,old_seam_nodes,nodes,edges,flow,phases,augmentations,changed,rolled_back,nanoseconds,"
+               "build_nanoseconds,max_flow_nanoseconds" << std::endl;
+        for (const auto &s: stats) {
+            out << s.x << ',' << s.y << ',' << s.overlapped << ',' << s.old_seam_nodes << ',' << s.nodes << ',' << s.edges
+                << ',' << s.flow << ',' << s.phases << ',' << s.augmentations << ',' << s.changed << ',' << s.rolled_back
+                << ',' << s.nanoseconds << ',' << s.build_nanoseconds << ',' << s.max_flow_nanoseconds << std::endl;
+        }
+    }
+
+    /// Cut the patch into the canvas, return the number of pixels taken by the patch (0 if rolled back)
+    int apply(const std::shared_ptr<Patch> &patch) {
+        Log::detail() << " > Applying a new patch at (" << patch->x << ", " << patch->y << ")";
+        TraceScope trace("apply", {{"x", patch->x}, {"y", patch->y}});
+        NanoTimer timer;
+        stats.push_back(ApplyStats());
+        stats.back().x = patch->x, stats.back().y = patch->y;
+        int changed = 0, rejected_before = rejected;
+        {
+            PROFILE_PHASE(commit);
+            switch (seam_cost) {
+                case SeamCostKind::plain: changed = commit<PlainSeamCost>(patch); break;
+                case SeamCostKind::gradient: changed = commit<GradientSeamCost>(patch); break;
+                case SeamCostKind::perceptual: changed = commit<PerceptualSeamCost>(patch); break;
             }
         }
+        stats.back().changed = changed, stats.back().rolled_back = rejected > rejected_before;
+        stats.back().nanoseconds = timer.tik();
+        PROFILE_COUNT(patches, 1);
+        PROFILE_COUNT(changed_pixels, changed);
+        trace.arg("changed", changed);
+        return changed;
     }
 };
\ No newline at end of file
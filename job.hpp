@@ -0,0 +1,139 @@
+#pragma once
+
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "image.hpp"
+#include "log.hpp"
+#include "options.hpp"
+#include "placer.hpp"
+#include "refiner.hpp"
+
+
+/// One synthesis: a texture into a `w` x `h` canvas written into `output` (kept in memory only if `-`), with a fixed seed
+/// if given
+struct Job {
+    std::string input, output;
+    int w = 0, h = 0;
+    std::optional<uint32_t> seed;
+    Options options;
+
+    /// Largest canvas a job may ask for, e.g. 4096x4096, each pixel costs its seam and matching buffers on top
+    static constexpr int64_t max_pixels = int64_t(1) << 24;
+
+    /// Parse a manifest line `<input> <output> <w>x<h> <seed|-> [options]`, the options follow `defaults`.
+    /// Return false with a reason in `error` on a malformed line.
+    [[nodiscard]] static bool parse(const std::string &line, const std::vector<std::string> &defaults, Job &job,
+                                    std::string &error) {
+        std::stringstream stream(line);
+        std::string size, seed;
+        if (not (stream >> job.input >> job.output >> size >> seed)) {
+            error = "expected <input> <output> <w>x<h> <seed|->";
+            return false;
+        }
+        char *end;
+        int64_t w = std::strtoll(size.c_str(), &end, 10), h = *end == 'x' ? std::strtoll(end + 1, &end, 10) : 0;
+        if (*end or w <= 0 or h <= 0) {
+            error = "bad canvas size " + size;
+            return false;
+        }
+        if (w > max_pixels / h) { // Not `w * h`, which may overflow
+            error = "canvas " + size + " larger than " + std::to_string(max_pixels) + " pixels";
+            return false;
+        }
+        job.w = w, job.h = h;
+        if (seed != "-") {
+            job.seed = std::strtoul(seed.c_str(), &end, 10);
+            if (*end) {
+                error = "bad seed " + seed;
+                return false;
+            }
+        }
+        std::vector<std::string> args = defaults;
+        for (std::string arg; stream >> arg;) {
+            args.push_back(arg);
+        }
+        return Options::parse(args, job.options, error);
+    }
+};
+
+
+/// Summary of a job with its result image (and its seams with `--seams`), `error` tells the first file that could not be written and `graph_stats`
+/// holds the table of `--graph-stats summary`, for the caller to print
+struct JobResult: Refiner::Result {
+    std::shared_ptr<Image> image, seams;
+    std::string error, graph_stats;
+};
+
+
+/// Synthesize a job from its (already read) texture and write the result, its seams and graph statistics
+JobResult synthesize(const Job &job, const std::shared_ptr<Image> &texture) {
+    const auto &options = job.options;
+    if (job.seed) {
+        RandomSeeder::seed(*job.seed);
+    }
+    Log::info() << "Making " << job.w << "x" << job.h << " canvas ...";
+    auto canvas = std::make_shared<Canvas>(job.w, job.h);
+    canvas->seam_cost = options.seam_cost;
+    canvas->acceptance = options.acceptance;
+    canvas->graph_dump_prefix = options.graph_dump_prefix;
+
+    JobResult result;
+    if (options.anytime_budget > 0) {
+        Log::info() << "Begin to synthesize within " << pretty_nanoseconds(options.anytime_budget) << ":";
+        auto anytime = Refiner::anytime(canvas, texture, options.anytime_budget, not options.seams_path.empty());
+        Log::info() << "Filled in " << pretty_nanoseconds(anytime.init_nanoseconds) << ", refined with " << anytime.iterations
+                  << " patches in " << pretty_nanoseconds(anytime.nanoseconds) << " total, best seam cost "
+                  << anytime.initial_seam_cost << " -> " << anytime.final_seam_cost << ", " << anytime.rejected << " rolled back";
+        static_cast<Refiner::Result&> (result) = anytime;
+        result.image = anytime.image, result.seams = anytime.seams;
+    } else {
+        if (options.pyramid_factor > 1) {
+            Log::info() << "Begin to synthesize coarse-to-fine (1/" << options.pyramid_factor << " resolution first):";
+            static_cast<Refiner::Result&> (result) = Refiner::pyramid(canvas, texture, options.pyramid_factor,
+                                                                      options.placement, options.criteria);
+        } else {
+            Log::info() << "Begin to apply patches on canvas:";
+            Placer::init(canvas, texture);
+            Log::info() << "Begin to refine:";
+            static_cast<Refiner::Result&> (result) = Refiner::refine(canvas, texture, options.placement, options.criteria);
+        }
+        Log::info() << "Refined with " << result.iterations << " patches in " << pretty_nanoseconds(result.nanoseconds)
+                  << " (stopped by " << result.reason << "), seam cost " << result.initial_seam_cost
+                  << " -> " << result.final_seam_cost << ", " << result.rejected << " rolled back";
+        result.image = canvas;
+        if (not options.seams_path.empty()) {
+            result.seams = canvas->seam_visualization();
+        }
+    }
+
+    auto save = [&result](const std::shared_ptr<Image> &image, const std::string &path) {
+        if (not image->save(path) and result.error.empty()) {
+            result.error = "Unable to write image to " + path;
+        }
+    };
+    if (job.output != "-") {
+        Log::info() << "Writing result into " << job.output << " ...";
+        save(result.image, job.output);
+    }
+    if (not options.seams_path.empty()) {
+        Log::info() << "Writing seams into " << options.seams_path << " ...";
+        save(result.seams, options.seams_path);
+    }
+    if (options.graph_stats == "summary") {
+        std::ostringstream table;
+        canvas->print_apply_stats(table);
+        result.graph_stats = table.str();
+    } else if (not options.graph_stats.empty()) {
+        Log::info() << "Writing graph statistics into " << options.graph_stats << " ...";
+        std::ofstream file(options.graph_stats);
+        canvas->write_apply_stats(file);
+    }
+    if (job.seed) {
+        RandomSeeder::unseed();
+    }
+    return result;
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+
+#include "cherry.hpp"
+
+
+/// How much is reported: nothing but errors, messages and a progress bar, or messages and a line per patch
+enum class Verbosity {
+    quiet, progress, verbose
+};
+
+
+/// Buffered console reporting: messages go out at once, details are kept until a full buffer, a message or `flush`.
+/// Safe to share between threads, a line is never interleaved with another.
+class Log {
+private:
+    std::atomic<Verbosity> verbosity = Verbosity::progress;
+    std::mutex mutex;
+    std::string buffer;
+
+    // The running progress bar, if any
+    const char *stage = nullptr, *stage_unit = nullptr;
+    uint64_t stage_begin = 0, last_draw = 0;
+    int64_t stage_done = 0, stage_total = 0;
+    bool stale = false;
+
+    static constexpr size_t buffer_limit = 1 << 16;
+    static constexpr uint64_t redraw_interval = 100'000'000;
+    static constexpr int bar_width = 30;
+
+    // The unlocked parts of the public methods, with `mutex` held
+
+    void write(const std::string &text) {
+        buffer += text;
+        if (buffer.size() >= buffer_limit) {
+            output();
+        }
+    }
+
+    void output() {
+        std::cout << buffer << std::flush;
+        buffer.clear();
+    }
+
+    void leave_bar() {
+        if (stage) {
+            if (stale) {
+                draw(NanoTimer::now());
+            }
+            stage = nullptr;
+            buffer += '\n';
+        }
+    }
+
+    void draw(uint64_t now) {
+        int64_t done = stage_done, total = stage_total;
+        const char *unit = stage_unit;
+        double seconds = (now - stage_begin) / 1e9;
+        int filled = total > 0 ? static_cast<int> (bar_width * std::min<int64_t>(done, total) / total) : 0;
+        char line[160];
+        std::snprintf(line, sizeof(line), "\r%-8s [%s%s] %lld/%lld %s, %.1f %s/s", stage, std::string(filled, '#').c_str(),
+                      std::string(bar_width - filled, ' ').c_str(), static_cast<long long> (done), static_cast<long long> (total),
+                      unit, seconds > 0 ? done / seconds : 0.0, unit);
+        buffer += line;
+        output();
+        last_draw = now, stale = false;
+    }
+
+public:
+    /// A line built with `<<` and committed when it goes out of scope, free when its level is hidden
+    class Line {
+    private:
+        Log *log;
+        bool immediate;
+        std::optional<std::ostringstream> stream;
+
+    public:
+        Line(Log *log, bool immediate): log(log), immediate(immediate) {
+            if (log) {
+                stream.emplace();
+            }
+        }
+
+        Line(Line &&line) noexcept: log(line.log), immediate(line.immediate), stream(std::move(line.stream)) {
+            line.log = nullptr;
+        }
+
+        ~Line() {
+            if (log) {
+                std::lock_guard<std::mutex> guard(log->mutex);
+                log->leave_bar();
+                log->write(stream->str() + '\n');
+                if (immediate) {
+                    log->output();
+                }
+            }
+        }
+
+        template <typename T>
+        Line &operator << (const T &value) {
+            if (log) {
+                *stream << value;
+            }
+            return *this;
+        }
+    };
+
+    static Log &instance() {
+        static Log log;
+        return log;
+    }
+
+    void set_verbosity(Verbosity level) {
+        verbosity = level;
+    }
+
+    [[nodiscard]] bool verbose() const {
+        return verbosity == Verbosity::verbose;
+    }
+
+    /// A message, shown unless quiet
+    [[nodiscard]] static Line info() {
+        auto &log = instance();
+        return Line(log.verbosity != Verbosity::quiet ? &log : nullptr, true);
+    }
+
+    /// A detail (e.g. every patch), shown only when verbose
+    [[nodiscard]] static Line detail() {
+        auto &log = instance();
+        return Line(log.verbose() ? &log : nullptr, false);
+    }
+
+    /// Report `done` out of `total` `unit`s of a stage, the bar is redrawn at most every 0.1 s with the rate so far
+    void progress(const char *name, int64_t done, int64_t total, const char *unit) {
+        if (verbosity != Verbosity::progress) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(mutex);
+        uint64_t now = NanoTimer::now();
+        if (stage != name) {
+            leave_bar();
+            stage = name, stage_begin = now, last_draw = 0;
+        }
+        stage_done = done, stage_total = total, stage_unit = unit, stale = true;
+        if (now - last_draw >= redraw_interval) {
+            draw(now);
+        }
+    }
+
+    /// Draw the final state of the progress bar and leave its line
+    void end_progress() {
+        std::lock_guard<std::mutex> guard(mutex);
+        leave_bar();
+    }
+
+    void flush() {
+        std::lock_guard<std::mutex> guard(mutex);
+        output();
+    }
+};
@@ -1,35 +1,103 @@
+#include <fstream>
 #include <iostream>
+#include <thread>
 
+#include "batch.hpp"
 #include "image.hpp"
-#include "placer.hpp"
+#include "job.hpp"
+#include "log.hpp"
+#include "options.hpp"
+#include "profiler.hpp"
+#include "server.hpp"
+#include "texture_cache.hpp"
+#include "trace.hpp"
 
 
 int main(int argc, char* argv[]) {
-    if (argc != 4) {
-        std::cout << "Usage: graph_cut <input> <output> <canvas_size>" << std::endl;
-        std::cout << "Example: graph_cut peas.png peas_output.png 512x512" << std::endl;
+    std::string mode = argc >= 3 ? argv[1] : "";
+    bool batch = mode == "--batch", serve = mode == "--serve";
+    if (argc < 4 and not batch and not serve) {
+        std::cout << "Usage: graph_cut <input> <output> <canvas_size> [options]" << std::endl;
+        std::cout << "       graph_cut --batch <manifest> [--workers <n>] [options]" << std::endl;
+        std::cout << "       graph_cut --serve <socket> [--workers <n>] [options]" << std::endl;
+        std::cout << "Example: graph_cut peas.png peas_output.png 512x512 --seam-cost gradient" << std::endl;
+        std::cout << "Manifest lines: <input> <output> <canvas_size> <seed|-> [options], after the command line options" << std::endl;
+        Options::usage();
         std::exit(EXIT_SUCCESS);
     }
 
-    std::cout << "Reading image from " << argv[1] << " ..." << std::endl;
-    auto texture = std::make_shared<Image>(argv[1]);
+    // Batch of jobs or server, `--workers` defaults to a worker per hardware thread
+    if (batch or serve) {
+        std::vector<std::string> defaults;
+        int workers = static_cast<int> (std::max(1u, std::thread::hardware_concurrency()));
+        for (int i = 3; i < argc; ++ i) {
+            if (std::string(argv[i]) == "--workers" and i + 1 < argc) {
+                workers = std::atoi(argv[++ i]);
+            } else {
+                defaults.emplace_back(argv[i]);
+            }
+        }
+        auto options = Options::parse(defaults);
 
-    int w, h;
-    sscanf(argv[3], "%dx%d", &w, &h);
-    std::cout << "Making " << w << "x" << h << " canvas ..." << std::endl;
-    auto canvas = std::make_shared<Canvas>(w, h);
+        // Every job would write the same file, these belong on the manifest lines or requests
+        if (not options.seams_path.empty() or not options.graph_dump_prefix.empty() or
+            not (options.graph_stats.empty() or options.graph_stats == "summary")) {
+            std::cerr << "--seams, --dump-graphs and --graph-stats <csv> name files per job, give them per job" << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        if (not options.trace_path.empty()) {
+            Tracer::instance().open(options.trace_path);
+        }
+        TextureCache cache(options.cache_budget, options.cache_directory);
+        int failures = 0;
+        if (batch) {
+            failures = Batch::run(argv[2], workers, defaults, cache);
+        } else {
+            Server(defaults, cache).run(argv[2], workers);
+        }
+        cache.spill_all();
+        Tracer::instance().close();
+        return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
 
-    std::cout << "Begin to apply patches on canvas:" << std::endl;
-    Placer::init(canvas, texture);
+    Job job;
+    job.input = argv[1], job.output = argv[2];
+    job.options = Options::parse(std::vector<std::string>(argv + 4, argv + argc));
+    sscanf(argv[3], "%dx%d", &job.w, &job.h);
+    const auto &options = job.options;
+    Log::instance().set_verbosity(options.verbosity);
+    if (not options.trace_path.empty()) {
+        Tracer::instance().open(options.trace_path);
+    }
 
-    // Refine
-    std::cout << "Begin to refine:" << std::endl;
-    for (int i = 0; i < 100; ++ i) {
-        Placer::entire_matching(canvas, texture);
+    Log::info() << "Reading image from " << job.input << " ...";
+    TextureCache cache(options.cache_budget, options.cache_directory);
+    auto texture = cache.get(job.input);
+    if (not texture) {
+        std::cerr << "Unable to load image from " << job.input << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    auto result = synthesize(job, texture);
+    cache.spill_all();
+    if (not result.error.empty()) {
+        std::cerr << result.error << std::endl;
+        std::exit(EXIT_FAILURE);
     }
+    Log::instance().flush();
+    std::cout << result.graph_stats;
 
-    std::cout << "Writing result into " << argv[2] << " ..." << std::endl;
-    canvas->write(argv[2]);
+    if (not options.trace_path.empty()) {
+        Log::info() << "Writing trace into " << options.trace_path << " ...";
+        Tracer::instance().close();
+    }
+    Log::instance().flush();
+    if (options.profile == "summary") {
+        Profiler::instance().summary(std::cout);
+    } else if (not options.profile.empty()) {
+        Log::info() << "Writing profile into " << options.profile << " ...";
+        std::ofstream file(options.profile);
+        Profiler::instance().json(file);
+    }
 
     return 0;
 }
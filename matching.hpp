@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "dft.hpp"
+#include "image.hpp"
+
+
+/// 2D prefix sums of the squared pixels of the `w` x `h` region at (`x_offset`, `y_offset`) of `planes`
+void prefix_square_sums(const Planes &planes, int x_offset, int y_offset, int w, int h, uint64_t *sum) {
+    for (int y = 0, index = 0; y < h; ++ y) {
+        for (int x = 0; x < w; ++ x, ++ index) {
+            auto up = y > 0 ? sum[index - w] : 0;
+            auto left = x > 0 ? sum[index - 1] : 0;
+            auto left_up = (y > 0 and x > 0) ? sum[index - w - 1] : 0;
+            sum[index] = up + left + planes.sqr_sum((y + y_offset) * planes.w + x + x_offset) - left_up;
+        }
+    }
+}
+
+
+/// The texture side of `Placer::fft_matching`, which only depends on the texture: its variance, the prefix sums of its
+/// squared pixels and the spectra of the flipped texture, one per DFT size. Built on first use and kept with the texture.
+struct MatchingData {
+    typedef std::pair<int, int> Size;
+
+    uint64_t variance = 0;
+    std::vector<uint64_t> square_sums;
+
+    MatchingData() = default;
+
+    explicit MatchingData(const Image &texture): variance(texture.variance()), square_sums(texture.w * texture.h) {
+        prefix_square_sums(texture.planes(), 0, 0, texture.w, texture.h, square_sums.data());
+    }
+
+    /// The spectrum of the flipped texture in a `dft_w` x `dft_h` DFT, computed once (concurrent callers may both
+    /// compute it, the first stored wins)
+    [[nodiscard]] std::shared_ptr<const ComplexPixel> spectrum(const std::shared_ptr<Image> &texture, int dft_w, int dft_h) {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            auto found = spectra.find(Size(dft_w, dft_h));
+            if (found != spectra.end()) {
+                return found->second;
+            }
+        }
+        ComplexPixel *dft_space;
+        dft_alloc(texture, dft_w, dft_h, dft_space, true);
+        dft(dft_w, dft_h, dft_space);
+        std::shared_ptr<const ComplexPixel> computed(dft_space, dft_free);
+        std::lock_guard<std::mutex> guard(mutex);
+        return spectra.emplace(Size(dft_w, dft_h), computed).first->second;
+    }
+
+    /// Add a spectrum read back from elsewhere (see `TextureCache`)
+    void add_spectrum(int dft_w, int dft_h, std::shared_ptr<const ComplexPixel> spectrum) {
+        std::lock_guard<std::mutex> guard(mutex);
+        spectra.emplace(Size(dft_w, dft_h), std::move(spectrum));
+    }
+
+    /// A snapshot of the spectra computed so far
+    [[nodiscard]] std::map<Size, std::shared_ptr<const ComplexPixel>> all_spectra() const {
+        std::lock_guard<std::mutex> guard(mutex);
+        return spectra;
+    }
+
+    [[nodiscard]] size_t bytes() const {
+        std::lock_guard<std::mutex> guard(mutex);
+        size_t total = square_sums.size() * sizeof(uint64_t);
+        for (const auto &[size, spectrum]: spectra) {
+            total += static_cast<size_t> (size.first) * size.second * sizeof(ComplexPixel);
+        }
+        return total;
+    }
+
+    /// The matching data of a texture, built on first use
+    [[nodiscard]] static MatchingData &of(const std::shared_ptr<Image> &texture) {
+        static std::mutex creation;
+        std::lock_guard<std::mutex> guard(creation);
+        if (not texture->matching_cache) {
+            texture->matching_cache = std::make_shared<MatchingData>(*texture);
+        }
+        return *texture->matching_cache;
+    }
+
+private:
+    mutable std::mutex mutex;
+    std::map<Size, std::shared_ptr<const ComplexPixel>> spectra;
+};
@@ -0,0 +1,196 @@
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "cherry.hpp"
+#include "graph.hpp"
+
+
+/// A seam graph read back from a DIMACS dump of `Canvas::dump_graph`
+struct DumpedGraph {
+    struct UndirectedEdge {
+        int u, v;
+        int64_t capacity; // -1 for infinite
+    };
+
+    std::string path;
+    int n = 0, s = -1, t = -1;
+    int64_t finite_capacity = 0;
+    std::vector<UndirectedEdge> edges;
+
+    /// Read a dump, each edge is written as two opposite arcs and kept once here
+    static DumpedGraph read(const std::string &path) {
+        std::ifstream file(path);
+        if (not file) {
+            std::cerr << "Failed to read graph from " << path << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        DumpedGraph graph;
+        graph.path = path;
+        int64_t infinity = INT64_MAX;
+        std::string line;
+        while (std::getline(file, line)) {
+            std::istringstream stream(line);
+            std::string kind;
+            stream >> kind;
+            if (kind == "c") {
+                std::string key;
+                if (stream >> key and key == "infinity") {
+                    stream >> infinity;
+                }
+            } else if (kind == "p") {
+                std::string problem;
+                stream >> problem >> graph.n;
+            } else if (kind == "n") {
+                int node;
+                std::string terminal;
+                stream >> node >> terminal;
+                (terminal == "s" ? graph.s : graph.t) = node - 1;
+            } else if (kind == "a") {
+                int u, v;
+                int64_t capacity;
+                stream >> u >> v >> capacity;
+                if (u < v) {
+                    bool inf = capacity >= infinity;
+                    graph.edges.push_back(UndirectedEdge{u - 1, v - 1, inf ? -1 : capacity});
+                    graph.finite_capacity += inf ? 0 : capacity;
+                }
+            }
+        }
+        if (graph.n <= 0 or graph.s < 0 or graph.t < 0) {
+            std::cerr << "Malformed graph " << path << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        return graph;
+    }
+};
+
+
+/// Totals of one solver over all the graphs it could take
+struct Solver {
+    std::string name;
+    int graphs = 0, mismatches = 0;
+    uint64_t nanoseconds = 0;
+    int64_t phases = 0, augmentations = 0;
+    size_t peak_memory = 0;
+};
+
+
+/// Solve `repeat` times keeping the fastest, compare the flow and the cut with the reference (filled by the first solver),
+/// the flow only if finite as an unavoidable infinite edge counts as the infinity of each capacity type
+template <typename capacity_t>
+void replay(const DumpedGraph &dumped, bool reduce, int repeat, Solver &solver, int64_t &reference_flow, std::vector<bool> &reference_cut) {
+    if (dumped.finite_capacity >= Graph<capacity_t>::inf_flow) {
+        return;
+    }
+    uint64_t best = UINT64_MAX;
+    for (int i = 0; i < repeat; ++ i) {
+        NanoTimer timer;
+        Graph<capacity_t> graph(dumped.n);
+        graph.edges.reserve(dumped.edges.size() * 2);
+        for (const auto &edge: dumped.edges) {
+            graph.add_edge(edge.u, edge.v, edge.capacity < 0 ? Graph<capacity_t>::inf_flow : edge.capacity);
+        }
+        if (reduce) {
+            graph.reduce(dumped.s, dumped.t);
+        }
+        const auto &decisions = graph.min_cut(dumped.s, dumped.t);
+        best = std::min(best, timer.tik());
+        if (i > 0) {
+            continue;
+        }
+
+        // Statistics and checks once
+        solver.phases += graph.phases, solver.augmentations += graph.augmentations;
+        solver.peak_memory = std::max(solver.peak_memory, graph.memory());
+        std::vector<bool> cut(dumped.n);
+        for (int u = 0; u < dumped.n; ++ u) {
+            cut[u] = decisions.get_bit(u);
+        }
+        if (reference_cut.empty()) {
+            reference_flow = graph.flow(dumped.s), reference_cut = cut;
+        } else if (reference_cut != cut or (reference_flow <= dumped.finite_capacity and reference_flow != graph.flow(dumped.s))) {
+            std::cerr << solver.name << " disagrees on " << dumped.path << std::endl;
+            ++ solver.mismatches;
+        }
+    }
+    solver.nanoseconds += best;
+    ++ solver.graphs;
+}
+
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cout << "Usage: maxflow_bench <graph.max|directory> ... [--repeat <n>]" << std::endl;
+        std::cout << "Example: maxflow_bench dumps --repeat 5" << std::endl;
+        std::exit(EXIT_SUCCESS);
+    }
+
+    // Inputs, directories expanded into their sorted `.max` files
+    int repeat = 1;
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++ i) {
+        std::string arg = argv[i];
+        if (arg == "--repeat" and i + 1 < argc) {
+            repeat = std::max(std::stoi(argv[++ i]), 1);
+        } else if (std::filesystem::is_directory(arg)) {
+            std::vector<std::string> files;
+            for (const auto &entry: std::filesystem::directory_iterator(arg)) {
+                if (entry.path().extension() == ".max") {
+                    files.push_back(entry.path().string());
+                }
+            }
+            std::sort(files.begin(), files.end());
+            paths.insert(paths.end(), files.begin(), files.end());
+        } else {
+            paths.push_back(arg);
+        }
+    }
+    if (paths.empty()) {
+        std::cerr << "No graphs given" << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    // The first solver takes every graph and gives the reference
+    std::vector<Solver> solvers = {{"dinic<int64>"}, {"dinic<int64> + reduce"}, {"dinic<int32>"}, {"dinic<int32> + reduce"},
+                                   {"dinic<uint16>"}, {"dinic<uint16> + reduce"}};
+    int64_t nodes = 0, edges = 0;
+    for (const auto &path: paths) {
+        auto dumped = DumpedGraph::read(path);
+        nodes += dumped.n, edges += dumped.edges.size();
+        int64_t reference_flow = 0;
+        std::vector<bool> reference_cut;
+        replay<int64_t>(dumped, false, repeat, solvers[0], reference_flow, reference_cut);
+        replay<int64_t>(dumped, true, repeat, solvers[1], reference_flow, reference_cut);
+        replay<int32_t>(dumped, false, repeat, solvers[2], reference_flow, reference_cut);
+        replay<int32_t>(dumped, true, repeat, solvers[3], reference_flow, reference_cut);
+        replay<uint16_t>(dumped, false, repeat, solvers[4], reference_flow, reference_cut);
+        replay<uint16_t>(dumped, true, repeat, solvers[5], reference_flow, reference_cut);
+    }
+
+    // Report
+    std::cout << paths.size() << " graphs, " << nodes << " nodes and " << edges << " edges in total, best of " << repeat << std::endl;
+    std::cout << std::left << std::setw(24) << "solver" << std::right << std::setw(8) << "graphs" << std::setw(16) << "time"
+              << std::setw(12) << "phases" << std::setw(16) << "augmentations" << std::setw(16) << "peak memory"
+              << std::setw(12) << "mismatches" << std::endl;
+    int mismatches = 0;
+    for (const auto &solver: solvers) {
+        std::cout << std::left << std::setw(24) << solver.name << std::right << std::setw(8) << solver.graphs
+                  << std::setw(16) << pretty_nanoseconds(solver.nanoseconds) << std::setw(12) << solver.phases
+                  << std::setw(16) << solver.augmentations << std::setw(13) << solver.peak_memory / 1024 << " KB"
+                  << std::setw(12) << solver.mismatches << std::endl;
+        mismatches += solver.mismatches;
+    }
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    std::cout << "Peak resident memory: " << usage.ru_maxrss / 1024 << " MB" << std::endl;
+
+    return mismatches > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "image.hpp"
+#include "log.hpp"
+#include "placer.hpp"
+#include "refiner.hpp"
+
+
+/// Synthesis options given after `<input> <output> <canvas_size>`, as `--key value` pairs
+struct Options {
+    SeamCostKind seam_cost = SeamCostKind::plain;
+    Acceptance acceptance;
+    PlacementKind placement = PlacementKind::entire;
+    RefineCriteria criteria;
+    uint64_t anytime_budget = 0;
+    int pyramid_factor = 1;
+    std::string seams_path;
+    std::string graph_dump_prefix;
+    std::string profile;
+    std::string trace_path;
+    std::string graph_stats;
+    size_t cache_budget = size_t(1024) << 20;
+    std::string cache_directory;
+    Verbosity verbosity = Verbosity::progress;
+
+    static void usage() {
+        std::cout << "Options:" << std::endl;
+        std::cout << "  --seam-cost <plain|gradient|perceptual>  seam cost between adjacent pixels (default: plain)" << std::endl;
+        std::cout << "  --placement <entire|error>               refinement placement, error focuses on the worst seams (default: entire)" << std::endl;
+        std::cout << "  --rollback <temperature>                 roll back refining patches raising the seam cost, annealing if positive" << std::endl;
+        std::cout << "  --iterations <n>                         maximum refining patches (default: 100)" << std::endl;
+        std::cout << "  --min-improvement <fraction>             stop when the seam cost improves less over 20 patches (default: 0.001)" << std::endl;
+        std::cout << "  --min-changed <fraction>                 stop when 20 patches change less of the canvas on average (default: 0.0005)" << std::endl;
+        std::cout << "  --budget <ms>                            wall-clock budget of the refinement, 0 for unlimited (default: 0)" << std::endl;
+        std::cout << "  --anytime <ms>                           fill and refine the worst seams within a total time budget" << std::endl;
+        std::cout << "  --pyramid <1|2|4>                        synthesize at 1 / factor resolution first, then refine (default: 1)" << std::endl;
+        std::cout << "  --seams <path>                           also write the seams (red, brighter for higher costs)" << std::endl;
+        std::cout << "  --dump-graphs <prefix>                   dump every seam graph into <prefix><patch>.max (DIMACS)" << std::endl;
+        std::cout << "  --profile <summary|path.json>            print the hot-path timers and counters, or write them as JSON" << std::endl;
+        std::cout << "  --log <quiet|progress|verbose>           console output, verbose adds a line per patch (default: progress)" << std::endl;
+        std::cout << "  --trace <path.json>                      write a timeline of the patches, DFTs and iterations (Chrome trace)" << std::endl;
+        std::cout << "  --graph-stats <summary|path.csv>         print histograms of the seam graphs and max-flows, or one CSV row per patch" << std::endl;
+        std::cout << "  --cache-memory <MiB>                     memory kept for decoded textures and their matching data (default: 1024)" << std::endl;
+        std::cout << "  --cache-dir <path>                       spill the texture cache into <path> and read it back in later runs" << std::endl;
+    }
+
+    /// Parse `--key value` pairs into `options`, return false with a reason in `error` on unknown or malformed ones
+    [[nodiscard]] static bool parse(const std::vector<std::string> &args, Options &options, std::string &error) {
+        int i = 0;
+        try {
+            for (; i < args.size(); i += 2) {
+                const auto &key = args[i];
+                if (i + 1 >= args.size()) {
+                    error = "Missing value for option " + key;
+                    return false;
+                }
+                const auto &value = args[i + 1];
+                if (key == "--seam-cost") {
+                    if (value == "plain") {
+                        options.seam_cost = SeamCostKind::plain;
+                    } else if (value == "gradient") {
+                        options.seam_cost = SeamCostKind::gradient;
+                    } else if (value == "perceptual") {
+                        options.seam_cost = SeamCostKind::perceptual;
+                    } else {
+                        error = "Unknown seam cost " + value;
+                        return false;
+                    }
+                } else if (key == "--placement") {
+                    if (value == "entire") {
+                        options.placement = PlacementKind::entire;
+                    } else if (value == "error") {
+                        options.placement = PlacementKind::error;
+                    } else {
+                        error = "Unknown placement " + value;
+                        return false;
+                    }
+                } else if (key == "--rollback") {
+                    options.acceptance.rollback = true;
+                    options.acceptance.temperature = std::stod(value);
+                } else if (key == "--iterations") {
+                    options.criteria.max_iterations = std::stoi(value);
+                } else if (key == "--min-improvement") {
+                    options.criteria.min_improvement = std::stod(value);
+                } else if (key == "--min-changed") {
+                    options.criteria.min_changed = std::stod(value);
+                } else if (key == "--budget") {
+                    options.criteria.budget = Unit::ms(std::stoull(value));
+                } else if (key == "--anytime") {
+                    options.anytime_budget = Unit::ms(std::stoull(value));
+                } else if (key == "--pyramid") {
+                    options.pyramid_factor = std::stoi(value);
+                    if (options.pyramid_factor != 1 and options.pyramid_factor != 2 and options.pyramid_factor != 4) {
+                        error = "Pyramid factor must be 1, 2 or 4";
+                        return false;
+                    }
+                } else if (key == "--seams") {
+                    options.seams_path = value;
+                } else if (key == "--dump-graphs") {
+                    options.graph_dump_prefix = value;
+                } else if (key == "--profile") {
+                    options.profile = value;
+                } else if (key == "--log") {
+                    if (value == "quiet") {
+                        options.verbosity = Verbosity::quiet;
+                    } else if (value == "progress") {
+                        options.verbosity = Verbosity::progress;
+                    } else if (value == "verbose") {
+                        options.verbosity = Verbosity::verbose;
+                    } else {
+                        error = "Unknown log level " + value;
+                        return false;
+                    }
+                } else if (key == "--trace") {
+                    options.trace_path = value;
+                } else if (key == "--graph-stats") {
+                    options.graph_stats = value;
+                } else if (key == "--cache-memory") {
+                    options.cache_budget = static_cast<size_t> (std::stoull(value)) << 20;
+                } else if (key == "--cache-dir") {
+                    options.cache_directory = value;
+                } else {
+                    error = "Unknown option " + key;
+                    return false;
+                }
+            }
+        } catch (const std::logic_error &) { // From `std::stoi` and the like
+            error = "Bad value for option " + args[i];
+            return false;
+        }
+        return true;
+    }
+
+    /// The same, exit on unknown or malformed options
+    [[nodiscard]] static Options parse(const std::vector<std::string> &args) {
+        Options options;
+        std::string error;
+        if (not parse(args, options, error)) {
+            std::cerr << error << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        return options;
+    }
+};
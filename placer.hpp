@@ -3,107 +3,103 @@
 #include "cherry.hpp"
 #include "dft.hpp"
 #include "image.hpp"
+#include "log.hpp"
+#include "matching.hpp"
+#include "profiler.hpp"
+
+
+enum class PlacementKind {
+    entire, error
+};
 
 
 class Placer {
 public:
     static void init(const std::shared_ptr<Canvas> &canvas, const std::shared_ptr<Image> &texture) {
+        PROFILE_PHASE(init);
+        TraceScope trace("init");
         auto random_y = Random(texture->h / 3, texture->h * 2 / 3);
         auto random_x = Random(texture->w / 3, texture->w * 2 / 3);
         for (int y = 0; y < canvas->h; y += random_y()) {
             for (int x = 0; x < canvas->w; x += random_x()) {
                 auto patch = std::make_shared<Patch>(texture, x, y);
                 canvas->apply(patch);
+                Log::instance().progress("fill", canvas->filled_pixels(), canvas->w * canvas->h, "pixels");
             }
         }
+        Log::instance().end_progress();
     }
 
-    static void random(const std::shared_ptr<Canvas> &canvas, const std::shared_ptr<Image> &texture) {
+    static int random(const std::shared_ptr<Canvas> &canvas, const std::shared_ptr<Image> &texture) {
         auto random_x = Random(0, texture->w - 1);
         auto random_y = Random(0, texture->h - 1);
         auto patch = std::make_shared<Patch>(texture, random_x(), random_y());
-        canvas->apply(patch);
+        return canvas->apply(patch);
     }
 
     // Bigger means more randomness
     static constexpr double possibility_k = 0.3;
 
-    static void entire_matching(const std::shared_ptr<Canvas> &canvas, const std::shared_ptr<Image> &texture, bool random=false, int times=100) {
-        std::shared_ptr<Patch> best_patch;
+    /// Pick a patch by FFT-based SSD matching among the placements whose top-left corner is in [x_begin, x_end) x [y_begin, y_end),
+    /// correlating only the canvas region those placements overlap
+    [[nodiscard]] static std::shared_ptr<Patch> fft_matching(const std::shared_ptr<Canvas> &canvas, const std::shared_ptr<Image> &texture,
+                                                             int x_begin, int y_begin, int x_end, int y_end) {
+        assert(0 <= x_begin and x_begin < x_end and x_end <= canvas->w);
+        assert(0 <= y_begin and y_begin < y_end and y_end <= canvas->h);
+        PROFILE_PHASE(fft);
+        int region_w = std::min(canvas->w, x_end - 1 + texture->w) - x_begin;
+        int region_h = std::min(canvas->h, y_end - 1 + texture->h) - y_begin;
 
-        if (random) {
-            auto random_x = Random(0, canvas->w - 1);
-            auto random_y = Random(0, canvas->h - 1);
+        // Prefix sum, the texture's is kept with it
+        assert(canvas->none_empty());
+        auto &matching = MatchingData::of(texture);
+        const uint64_t *texture_sum = matching.square_sums.data();
+        auto *canvas_sum = static_cast<uint64_t*> (std::malloc(region_w * region_h * sizeof(uint64_t)));
+        auto query = [](const uint64_t *sum, int x, int y, int size_x, int size_y, int w, int h) {
+            int last_x = x + size_x - 1, last_y = y + size_y - 1;
+            uint64_t result = sum[last_y * w + last_x];
+            result += (x > 0 and y > 0) ? sum[(y - 1) * w + x - 1] : 0;
+            result -= x > 0 ? sum[last_y * w + x - 1] : 0;
+            result -= y > 0 ? sum[(y - 1) * w + last_x] : 0;
+            return result;
+        };
+        prefix_square_sums(canvas->planes(), x_begin, y_begin, region_w, region_h, canvas_sum);
 
-            uint64_t best_ssd = UINT64_MAX;
-            for (int i = 0; i < times; ++ i) {
-                auto patch = std::make_shared<Patch>(texture, random_x(), random_y());
-                uint64_t ssd = canvas->ssd(patch);
-                if (ssd < best_ssd) {
-                    best_ssd = ssd;
-                    best_patch = patch;
-                }
-            }
-        } else {
-            // FFT-based acceleration
-            // Prefix sum
-            assert(canvas->none_empty());
-            auto *texture_sum = static_cast<uint64_t*> (std::malloc(texture->w * texture->h * sizeof(uint64_t)));
-            auto *canvas_sum = static_cast<uint64_t*> (std::malloc(canvas->w * canvas->h * sizeof(uint64_t)));
-            auto query = [](const uint64_t *sum, int x, int y, int size_x, int size_y, int w, int h) {
-                int last_x = x + size_x - 1, last_y = y + size_y - 1;
-                uint64_t result = sum[last_y * w + last_x];
-                result += (x > 0 and y > 0) ? sum[(y - 1) * w + x - 1] : 0;
-                result -= x > 0 ? sum[last_y * w + x - 1] : 0;
-                result -= y > 0 ? sum[(y - 1) * w + last_x] : 0;
-                return result;
-            };
-            auto do_prefix_sum = [](int w, int h, Pixel *pixels, uint64_t *sum) {
-                for (int y = 0, index = 0; y < h; ++ y) {
-                    for (int x = 0; x < w; ++ x, ++ index) {
-                        auto up = y > 0 ? sum[index - w] : 0;
-                        auto left = x > 0 ? sum[index - 1] : 0;
-                        auto left_up = (y > 0 and x > 0) ? sum[index - w - 1] : 0;
-                        sum[index] = up + left + pixels[index].sqr_sum() - left_up;
-                    }
-                }
-            };
-            do_prefix_sum(texture->w, texture->h, texture->data, texture_sum);
-            do_prefix_sum(canvas->w, canvas->h, canvas->data, canvas_sum);
-
-            // FFT
-            auto flipped = texture->flip();
-            int dft_w = dft_round(texture->w + canvas->w), dft_h = dft_round(texture->h + canvas->h);
-            ComplexPixel *dft_space1, *dft_space2;
-            dft_alloc(flipped, dft_w, dft_h, dft_space1);
-            dft_alloc(canvas, dft_w, dft_h, dft_space2);
-            dft(dft_w, dft_h, dft_space1);
-            dft(dft_w, dft_h, dft_space2);
-            dft_multiply(dft_w, dft_h, dft_space1, dft_space2);
-            dft(dft_w, dft_h, dft_space1, true);
-
-            // Get results
-            uint64_t variance = texture->variance();
-            auto *possibility = static_cast<double*> (std::malloc(canvas->h * canvas->w * sizeof(double)));
-            for (int y = 0, index = 0; y < canvas->h; ++ y) {
-                for (int x = 0; x < canvas->w; ++ x, ++ index) {
-                    int overlapped_w = std::min(texture->w, canvas->w - x);
-                    int overlapped_h = std::min(texture->h, canvas->h - y);
+        // FFT, the spectrum of the texture is computed once per DFT size
+        int dft_w = dft_round(texture->w + region_w), dft_h = dft_round(texture->h + region_h);
+        auto texture_spectrum = matching.spectrum(texture, dft_w, dft_h);
+        ComplexPixel *dft_space;
+        dft_alloc(canvas, dft_w, dft_h, dft_space, false, x_begin, y_begin, region_w, region_h);
+        dft(dft_w, dft_h, dft_space);
+        dft_multiply(dft_w, dft_h, dft_space, texture_spectrum.get());
+        dft(dft_w, dft_h, dft_space, true);
+
+        // Get results
+        std::shared_ptr<Patch> best_patch;
+        {
+            PROFILE_PHASE(sampling);
+            uint64_t variance = matching.variance;
+            int candidates_w = x_end - x_begin, candidates_h = y_end - y_begin;
+            auto *possibility = static_cast<double*> (std::malloc(candidates_w * candidates_h * sizeof(double)));
+            for (int y = 0, index = 0; y < candidates_h; ++ y) {
+                for (int x = 0; x < candidates_w; ++ x, ++ index) {
+                    int overlapped_w = std::min(texture->w, region_w - x);
+                    int overlapped_h = std::min(texture->h, region_h - y);
                     uint64_t ssd = 0;
                     ssd += texture_sum[(overlapped_h - 1) * texture->w + overlapped_w - 1];
-                    ssd += query(canvas_sum, x, y, overlapped_w, overlapped_h, canvas->w, canvas->h);
-                    ssd -= std::floor(2.0 * dft_space1[(texture->h + y - 1) * dft_w + texture->w + x - 1].real_sum());
+                    ssd += query(canvas_sum, x, y, overlapped_w, overlapped_h, region_w, region_h);
+                    ssd -= std::floor(2.0 * dft_space[(texture->h + y - 1) * dft_w + texture->w + x - 1].real_sum());
                     ssd /= overlapped_w * overlapped_h;
                     possibility[index] = std::exp(-1.0 * ssd / (possibility_k * variance));
                 }
             }
             double possibility_sum = 0;
-            for (int i = 0; i < canvas->h * canvas->w; ++ i) {
+            for (int i = 0; i < candidates_w * candidates_h; ++ i) {
                 possibility_sum += possibility[i];
             }
             double position = Random<double>(0, 1)(), up = 0;
-            for (int y = 0, index = 0; y < canvas->h and not best_patch; ++ y) {
-                for (int x = 0; x < canvas->w; ++ x, ++ index) {
+            for (int y = y_begin, index = 0; y < y_end and not best_patch; ++ y) {
+                for (int x = x_begin; x < x_end; ++ x, ++ index) {
                     possibility[index] /= possibility_sum;
                     if (up + possibility[index] >= position) {
                         best_patch = std::make_shared<Patch>(texture, x, y);
@@ -112,19 +108,107 @@ public:
                     up += possibility[index];
                 }
             }
-            assert(best_patch);
-
-            // Free resources
+            // Rounding may leave the accumulated possibility slightly below `position`
+            if (not best_patch) {
+                best_patch = std::make_shared<Patch>(texture, x_end - 1, y_end - 1);
+            }
             std::free(possibility);
-            std::free(texture_sum);
-            std::free(canvas_sum);
-            dft_free(dft_space1);
-            dft_free(dft_space2);
         }
-        canvas->apply(best_patch);
+
+        // Free resources
+        std::free(canvas_sum);
+        dft_free(dft_space);
+        return best_patch;
+    }
+
+    static int entire_matching(const std::shared_ptr<Canvas> &canvas, const std::shared_ptr<Image> &texture, bool random=false, int times=100) {
+        PROFILE_PROBE(entire_matching);
+        std::shared_ptr<Patch> best_patch;
+
+        if (random) {
+            PROFILE_PHASE(sampling);
+            auto random_x = Random(0, canvas->w - 1);
+            auto random_y = Random(0, canvas->h - 1);
+
+            uint64_t best_ssd = UINT64_MAX;
+            for (int i = 0; i < times; ++ i) {
+                auto patch = std::make_shared<Patch>(texture, random_x(), random_y());
+                uint64_t ssd = canvas->ssd(patch);
+                if (ssd < best_ssd) {
+                    best_ssd = ssd;
+                    best_patch = patch;
+                }
+            }
+        } else {
+            // FFT-based acceleration
+            best_patch = fft_matching(canvas, texture, 0, 0, canvas->w, canvas->h);
+        }
+        return canvas->apply(best_patch);
+    }
+
+    /// Find the window (half of the texture size) with the highest accumulated seam cost, false if there are no seams
+    static bool worst_seam_window(const std::shared_ptr<Canvas> &canvas, const std::shared_ptr<Image> &texture,
+                                  int &window_x, int &window_y, int &window_w, int &window_h) {
+        window_x = window_y = 0;
+        if (canvas->total_seam_cost() == 0) {
+            return false;
+        }
+        int w = canvas->w, h = canvas->h;
+        window_w = std::min(std::max(texture->w / 2, 1), w);
+        window_h = std::min(std::max(texture->h / 2, 1), h);
+
+        // Summed-area table over the seam costs, with a zero row and column in front
+        std::vector<uint64_t> sum((w + 1) * (h + 1), 0);
+        for (int y = 0; y < h; ++ y) {
+            for (int x = 0; x < w; ++ x) {
+                uint64_t error = std::max(canvas->seam_right(x, y), 0) + std::max(canvas->seam_down(x, y), 0);
+                sum[(y + 1) * (w + 1) + x + 1] = sum[y * (w + 1) + x + 1] + sum[(y + 1) * (w + 1) + x] - sum[y * (w + 1) + x] + error;
+            }
+        }
+        uint64_t worst = 0;
+        for (int y = 0; y + window_h <= h; ++ y) {
+            for (int x = 0; x + window_w <= w; ++ x) {
+                uint64_t error = sum[(y + window_h) * (w + 1) + x + window_w] + sum[y * (w + 1) + x] -
+                                 sum[y * (w + 1) + x + window_w] - sum[(y + window_h) * (w + 1) + x];
+                if (error > worst) {
+                    worst = error, window_x = x, window_y = y;
+                }
+            }
+        }
+        return worst > 0;
+    }
+
+    /// Match only within a canvas window: sample placements whose top-left corner is in [x, x + w) x [y, y + h),
+    /// the FFT size depends on the window and the texture instead of the canvas
+    static int window_matching(const std::shared_ptr<Canvas> &canvas, const std::shared_ptr<Image> &texture, int x, int y, int w, int h) {
+        int x_begin = std::max(x, 0), x_end = std::min(x + w, canvas->w);
+        int y_begin = std::max(y, 0), y_end = std::min(y + h, canvas->h);
+        return canvas->apply(fft_matching(canvas, texture, x_begin, y_begin, x_end, y_end));
+    }
+
+    /// Place a patch covering the window with the worst seams (the "error region" strategy of the paper)
+    static int error_matching(const std::shared_ptr<Canvas> &canvas, const std::shared_ptr<Image> &texture) {
+        int window_x = 0, window_y = 0, window_w, window_h;
+        if (not worst_seam_window(canvas, texture, window_x, window_y, window_w, window_h)) {
+            return entire_matching(canvas, texture);
+        }
+
+        // Placements covering the entire window
+        int x_begin = std::max(window_x + window_w - texture->w, 0);
+        int y_begin = std::max(window_y + window_h - texture->h, 0);
+        return window_matching(canvas, texture, x_begin, y_begin, window_x + 1 - x_begin, window_y + 1 - y_begin);
+    }
+
+    /// Place one refining patch with the given strategy, return the number of changed pixels
+    static int refine(const std::shared_ptr<Canvas> &canvas, const std::shared_ptr<Image> &texture, PlacementKind placement) {
+        switch (placement) {
+            case PlacementKind::entire: return entire_matching(canvas, texture);
+            case PlacementKind::error: return error_matching(canvas, texture);
+        }
+        return 0;
     }
 
-    static void sub_patch_matching(const std::shared_ptr<Canvas> &canvas, const std::shared_ptr<Image> &texture, int times=100) {
+    static int sub_patch_matching(const std::shared_ptr<Canvas> &canvas, const std::shared_ptr<Image> &texture, int times=100) {
         int sub_patch_w = texture->w / 3, sub_patch_h = texture->h / 3;
         auto random_canvas_x = Random(0, canvas->w - sub_patch_w), random_canvas_y = Random(0, canvas->h - sub_patch_h);
         int canvas_x = random_canvas_x(), canvas_y = random_canvas_y();
@@ -142,6 +226,6 @@ public:
                 best_patch = patch;
             }
         }
-        canvas->apply(best_patch);
+        return canvas->apply(best_patch);
     }
 };
\ No newline at end of file
@@ -0,0 +1,224 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <vector>
+
+#include "cherry.hpp"
+
+
+/// Phases of the synthesis, timed exclusively: a phase entered inside another pauses the outer one, except inside the
+/// initial fill which takes everything it runs
+enum class Phase: int {
+    init, fft, sampling, graph_build, max_flow, commit, count
+};
+
+
+/// Hot spots timed inclusively, with call counts and extremes
+enum class Probe: int {
+    entire_matching, dft, graph_build, min_cut, read_image, write_image, count
+};
+
+
+/// Quantities summed over a run
+enum class Counter: int {
+    patches, changed_pixels, overlapped_pixels, graph_nodes, graph_edges, count
+};
+
+
+/// Per-thread phase times, probe timers and counters of a run, see the `PROFILE_*` macros for the instrumentation
+class Profiler {
+public:
+    struct ProbeStats {
+        uint64_t calls = 0, nanoseconds = 0, min = UINT64_MAX, max = 0;
+    };
+
+private:
+    static constexpr int n_phases = static_cast<int> (Phase::count);
+    static constexpr int n_probes = static_cast<int> (Probe::count);
+    static constexpr int n_counters = static_cast<int> (Counter::count);
+
+    uint64_t nanoseconds[n_phases] = {};
+    std::vector<Phase> stack;
+    NanoTimer timer;
+
+    ProbeStats probes[n_probes];
+    uint64_t probe_begins[n_probes] = {};
+    int64_t counters[n_counters] = {};
+
+    // Charge the time since the last event to the innermost phase
+    void charge() {
+        uint64_t duration = timer.tik();
+        if (not stack.empty()) {
+            nanoseconds[static_cast<int> (stack.back())] += duration;
+        }
+    }
+
+public:
+    static Profiler &instance() {
+        thread_local Profiler profiler;
+        return profiler;
+    }
+
+    static const char *name(Phase phase) {
+        static const char *names[n_phases] = {
+                "init fill", "fft", "sampling", "graph build", "max-flow", "commit"
+        };
+        return names[static_cast<int> (phase)];
+    }
+
+    static const char *name(Probe probe) {
+        static const char *names[n_probes] = {
+                "entire_matching", "dft", "graph_build", "min_cut", "read_image", "write_image"
+        };
+        return names[static_cast<int> (probe)];
+    }
+
+    static const char *name(Counter counter) {
+        static const char *names[n_counters] = {
+                "patches", "changed_pixels", "overlapped_pixels", "graph_nodes", "graph_edges"
+        };
+        return names[static_cast<int> (counter)];
+    }
+
+    void enter(Phase phase) {
+        charge();
+        stack.push_back(not stack.empty() and stack.back() == Phase::init ? Phase::init : phase);
+    }
+
+    void leave() {
+        charge();
+        stack.pop_back();
+    }
+
+    /// Start a probe, which must not be running already
+    void begin(Probe probe) {
+        probe_begins[static_cast<int> (probe)] = NanoTimer::now();
+    }
+
+    void end(Probe probe) {
+        uint64_t duration = NanoTimer::now() - probe_begins[static_cast<int> (probe)];
+        auto &stats = probes[static_cast<int> (probe)];
+        ++ stats.calls, stats.nanoseconds += duration;
+        stats.min = std::min(stats.min, duration), stats.max = std::max(stats.max, duration);
+    }
+
+    void count(Counter counter, int64_t value) {
+        counters[static_cast<int> (counter)] += value;
+    }
+
+    /// Clear the times and counters (of phases and probes not running)
+    void reset() {
+        std::fill(nanoseconds, nanoseconds + n_phases, 0);
+        std::fill(probes, probes + n_probes, ProbeStats());
+        std::fill(counters, counters + n_counters, 0);
+    }
+
+    [[nodiscard]] uint64_t time(Phase phase) const {
+        return nanoseconds[static_cast<int> (phase)];
+    }
+
+    [[nodiscard]] const ProbeStats &stats(Probe probe) const {
+        return probes[static_cast<int> (probe)];
+    }
+
+    [[nodiscard]] int64_t value(Counter counter) const {
+        return counters[static_cast<int> (counter)];
+    }
+
+    /// Human-readable report of the probes and the counters
+    void summary(std::ostream &out) const {
+        out << std::left << std::setw(20) << "probe" << std::right << std::setw(10) << "calls" << std::setw(18) << "total"
+            << std::setw(18) << "mean" << std::setw(18) << "max" << std::endl;
+        for (int i = 0; i < n_probes; ++ i) {
+            const auto &stats = probes[i];
+            out << std::left << std::setw(20) << name(static_cast<Probe> (i)) << std::right << std::setw(10) << stats.calls
+                << std::setw(18) << pretty_nanoseconds(stats.nanoseconds)
+                << std::setw(18) << pretty_nanoseconds(stats.calls ? stats.nanoseconds / stats.calls : 0)
+                << std::setw(18) << pretty_nanoseconds(stats.max) << std::endl;
+        }
+        for (int i = 0; i < n_counters; ++ i) {
+            out << std::left << std::setw(20) << name(static_cast<Counter> (i)) << std::right << std::setw(10)
+                << counters[i] << std::endl;
+        }
+    }
+
+    /// The same in JSON, times in nanoseconds
+    void json(std::ostream &out) const {
+        out << "{\"phases\": {";
+        for (int i = 0; i < n_phases; ++ i) {
+            out << (i ? ", " : "") << "\"" << name(static_cast<Phase> (i)) << "\": " << nanoseconds[i];
+        }
+        out << "}, \"probes\": {";
+        for (int i = 0; i < n_probes; ++ i) {
+            const auto &stats = probes[i];
+            out << (i ? ", " : "") << "\"" << name(static_cast<Probe> (i)) << "\": {\"calls\": " << stats.calls
+                << ", \"nanoseconds\": " << stats.nanoseconds << ", \"min\": " << (stats.calls ? stats.min : 0)
+                << ", \"max\": " << stats.max << "}";
+        }
+        out << "}, \"counters\": {";
+        for (int i = 0; i < n_counters; ++ i) {
+            out << (i ? ", " : "") << "\"" << name(static_cast<Counter> (i)) << "\": " << counters[i];
+        }
+        out << "}}" << std::endl;
+    }
+};
+
+
+/// Time a scope as a phase
+class ScopedPhase {
+public:
+    explicit ScopedPhase(Phase phase) {
+        Profiler::instance().enter(phase);
+    }
+
+    ~ScopedPhase() {
+        Profiler::instance().leave();
+    }
+
+    ScopedPhase(const ScopedPhase &) = delete;
+    ScopedPhase &operator = (const ScopedPhase &) = delete;
+};
+
+
+/// Time a scope as a probe
+class ScopedProbe {
+private:
+    Probe probe;
+
+public:
+    explicit ScopedProbe(Probe probe): probe(probe) {
+        Profiler::instance().begin(probe);
+    }
+
+    ~ScopedProbe() {
+        Profiler::instance().end(probe);
+    }
+
+    ScopedProbe(const ScopedProbe &) = delete;
+    ScopedProbe &operator = (const ScopedProbe &) = delete;
+};
+
+
+// Instrumentation, compiled out with `GRAPH_CUT_NO_PROFILE`
+#ifndef GRAPH_CUT_NO_PROFILE
+#define PROFILE_NAME_CONCAT(line) profile_scope_ ## line
+#define PROFILE_NAME(line) PROFILE_NAME_CONCAT(line)
+#define PROFILE_PHASE(phase) ScopedPhase PROFILE_NAME(__LINE__)(Phase::phase)
+#define PROFILE_PROBE(probe) ScopedProbe PROFILE_NAME(__LINE__)(Probe::probe)
+#define PROFILE_ENTER(phase) Profiler::instance().enter(Phase::phase)
+#define PROFILE_LEAVE() Profiler::instance().leave()
+#define PROFILE_BEGIN(probe) Profiler::instance().begin(Probe::probe)
+#define PROFILE_END(probe) Profiler::instance().end(Probe::probe)
+#define PROFILE_COUNT(counter, value) Profiler::instance().count(Counter::counter, value)
+#else
+#define PROFILE_PHASE(phase) static_cast<void> (0)
+#define PROFILE_PROBE(probe) static_cast<void> (0)
+#define PROFILE_ENTER(phase) static_cast<void> (0)
+#define PROFILE_LEAVE() static_cast<void> (0)
+#define PROFILE_BEGIN(probe) static_cast<void> (0)
+#define PROFILE_END(probe) static_cast<void> (0)
+#define PROFILE_COUNT(counter, value) static_cast<void> (0)
+#endif
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "cherry.hpp"
+#include "image.hpp"
+#include "log.hpp"
+#include "placer.hpp"
+
+
+/// When to stop refining
+struct RefineCriteria {
+    /// Upper bound of refining patches
+    int max_iterations = 100;
+
+    /// Iterations the improvement and changed pixels are measured over
+    int window = 20;
+
+    /// Stop when the best total seam cost improved by less than this fraction over the window
+    double min_improvement = 0.001;
+
+    /// Stop when the patches in the window changed less than this fraction of the canvas on average
+    double min_changed = 0.0005;
+
+    /// Wall-clock budget in nanoseconds, 0 for unlimited
+    uint64_t budget = 0;
+};
+
+
+/// Refinement driver, placing patches until the seams converge or the budget expires
+class Refiner {
+private:
+    /// Whether the patch overlaps any filled pixel of the canvas
+    [[nodiscard]] static bool overlaps(const std::shared_ptr<Canvas> &canvas, const std::shared_ptr<Patch> &patch) {
+        for (int y = std::max(patch->y, 0); y < std::min(patch->y_end(), canvas->h); ++ y) {
+            for (int x = std::max(patch->x, 0); x < std::min(patch->x_end(), canvas->w); ++ x) {
+                if (canvas->filled(x, y)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+public:
+    /// Summary of a refinement run
+    struct Result {
+        int iterations = 0, rejected = 0;
+        uint64_t initial_seam_cost = 0, final_seam_cost = 0;
+        uint64_t nanoseconds = 0;
+        const char *reason = "iterations";
+    };
+
+    [[nodiscard]] static Result refine(const std::shared_ptr<Canvas> &canvas, const std::shared_ptr<Image> &texture,
+                                       PlacementKind placement, const RefineCriteria &criteria) {
+        Result result;
+        result.initial_seam_cost = canvas->total_seam_cost();
+        int rejected_before = canvas->rejections();
+
+        // `best[i]` is the lowest total seam cost after `i` iterations, `changed[i]` the pixels changed by iteration `i`
+        std::vector<uint64_t> best = {canvas->total_seam_cost()};
+        std::vector<int> changed;
+        NanoTimer timer;
+        while (result.iterations < criteria.max_iterations) {
+            if (criteria.budget > 0 and result.nanoseconds >= criteria.budget) {
+                result.reason = "budget";
+                break;
+            }
+            {
+                TraceScope trace("refine", {{"iteration", result.iterations}});
+                changed.push_back(Placer::refine(canvas, texture, placement));
+                trace.arg("seam_cost", canvas->total_seam_cost());
+            }
+            best.push_back(std::min(best.back(), canvas->total_seam_cost()));
+            ++ result.iterations;
+            result.nanoseconds += timer.tik();
+            Log::instance().progress("refine", result.iterations, criteria.max_iterations, "patches");
+
+            // Convergence over the last window
+            if (result.iterations >= criteria.window) {
+                uint64_t before = best[result.iterations - criteria.window], now = best[result.iterations];
+                double improvement = before > 0 ? static_cast<double> (before - now) / before : 0;
+                double changed_sum = 0;
+                for (int i = result.iterations - criteria.window; i < result.iterations; ++ i) {
+                    changed_sum += changed[i];
+                }
+                double changed_fraction = changed_sum / criteria.window / (canvas->w * canvas->h);
+                if (improvement < criteria.min_improvement) {
+                    result.reason = "converged";
+                    break;
+                }
+                if (changed_fraction < criteria.min_changed) {
+                    result.reason = "unchanged";
+                    break;
+                }
+            }
+        }
+        Log::instance().end_progress();
+        result.final_seam_cost = canvas->total_seam_cost();
+        result.rejected = canvas->rejections() - rejected_before;
+        return result;
+    }
+
+    /// Coarse-to-fine synthesis: fill and refine at 1 / `factor` resolution with `placement`, replay the surviving
+    /// placements scaled up with a local search of +-(`factor` - 1) pixels around each, then refine the worst seams at full
+    /// resolution with error placement. The coarse level gets up to half of the iterations and of the budget, the fine
+    /// level what is left; the result counts both levels, its seam costs are those of the full resolution.
+    [[nodiscard]] static Result pyramid(const std::shared_ptr<Canvas> &canvas, const std::shared_ptr<Image> &texture, int factor,
+                                        PlacementKind placement, const RefineCriteria &criteria) {
+        // Keep the coarse texture at least 8 pixels wide and high
+        while (factor > 1 and (texture->w / factor < 8 or texture->h / factor < 8 or canvas->w / factor < 8 or canvas->h / factor < 8)) {
+            factor /= 2;
+        }
+        if (factor <= 1) {
+            Placer::init(canvas, texture);
+            return refine(canvas, texture, placement, criteria);
+        }
+
+        // Coarse level
+        NanoTimer timer;
+        auto coarse_criteria = criteria;
+        coarse_criteria.max_iterations = criteria.max_iterations / 2;
+        coarse_criteria.budget = criteria.budget / 2;
+        auto coarse_texture = texture->downsample(factor);
+        auto coarse_canvas = std::make_shared<Canvas>(canvas->w / factor, canvas->h / factor);
+        coarse_canvas->seam_cost = canvas->seam_cost;
+        coarse_canvas->acceptance = canvas->acceptance;
+        Placer::init(coarse_canvas, coarse_texture);
+        auto coarse = refine(coarse_canvas, coarse_texture, placement, coarse_criteria);
+
+        // Upsample the placement map
+        for (const auto &coarse_patch: coarse_canvas->patches()) {
+            int x = coarse_patch->x * factor, y = coarse_patch->y * factor;
+            auto best_patch = std::make_shared<Patch>(texture, x, y);
+            uint64_t best_ssd = UINT64_MAX;
+            for (int dy = -factor + 1; dy < factor; ++ dy) {
+                for (int dx = -factor + 1; dx < factor; ++ dx) {
+                    auto patch = std::make_shared<Patch>(texture, x + dx, y + dy);
+                    if (not overlaps(canvas, patch)) {
+                        continue;
+                    }
+                    uint64_t ssd = canvas->ssd(patch);
+                    if (ssd < best_ssd) {
+                        best_ssd = ssd, best_patch = patch;
+                    }
+                }
+            }
+            canvas->apply(best_patch);
+        }
+
+        // Cover what the scaled and shifted placements missed (e.g. the canvas remainder not divisible by `factor`)
+        for (int y = 0; y < canvas->h; ++ y) {
+            for (int x = 0; x < canvas->w; ++ x) {
+                if (not canvas->filled(x, y)) {
+                    canvas->apply(std::make_shared<Patch>(texture, std::max(x - texture->w / 2, 0), std::max(y - texture->h / 2, 0)));
+                }
+            }
+        }
+
+        // Fine level, only the worst seams need another look and an entire matching costs a full-canvas FFT each
+        uint64_t coarse_nanoseconds = timer.tik();
+        auto fine_criteria = criteria;
+        fine_criteria.max_iterations = criteria.max_iterations - coarse.iterations;
+        if (criteria.budget > 0) { // At least a nanosecond, 0 would be unlimited
+            fine_criteria.budget = std::max<uint64_t>(criteria.budget - std::min(criteria.budget, coarse_nanoseconds), 1);
+        }
+        auto result = refine(canvas, texture, PlacementKind::error, fine_criteria);
+        result.iterations += coarse.iterations;
+        result.rejected += coarse.rejected;
+        result.nanoseconds += coarse_nanoseconds;
+        return result;
+    }
+
+    /// Summary of an anytime run, with the best canvas seen and its seam visualization if asked for
+    struct AnytimeResult: Result {
+        uint64_t init_nanoseconds = 0;
+        std::shared_ptr<Image> image, seams;
+    };
+
+    /// Fill the canvas, then refine the worst seams until `budget` nanoseconds (including the fill) would be exceeded.
+    /// The fill always completes since nothing before it is a valid image, refinement stops between two patches.
+    /// With `keep_seams`, the seams of the best canvas are drawn whenever it is kept, the canvas itself moves on.
+    [[nodiscard]] static AnytimeResult anytime(const std::shared_ptr<Canvas> &canvas, const std::shared_ptr<Image> &texture,
+                                               uint64_t budget, bool keep_seams=false, int max_iterations=INT32_MAX) {
+        AnytimeResult result;
+        NanoTimer timer;
+        Placer::init(canvas, texture);
+        result.init_nanoseconds = timer.tik();
+        result.nanoseconds = result.init_nanoseconds;
+        result.initial_seam_cost = result.final_seam_cost = canvas->total_seam_cost();
+        result.image = canvas->copy();
+        if (keep_seams) {
+            result.seams = canvas->seam_visualization();
+        }
+
+        // Predict the next patch by the slowest recent one, the cost varies with the overlap
+        uint64_t predicted = 0;
+        result.reason = "budget";
+        while (result.nanoseconds + predicted <= budget) {
+            if (result.iterations == max_iterations) {
+                result.reason = "iterations";
+                break;
+            }
+            {
+                TraceScope trace("refine", {{"iteration", result.iterations}});
+                Placer::refine(canvas, texture, PlacementKind::error);
+                trace.arg("seam_cost", canvas->total_seam_cost());
+            }
+            ++ result.iterations;
+            uint64_t elapsed = timer.tik();
+            result.nanoseconds += elapsed;
+            predicted = std::max(predicted * 7 / 8, elapsed);
+            Log::instance().progress("refine", static_cast<int64_t> (result.nanoseconds / 1'000'000),
+                                     static_cast<int64_t> (budget / 1'000'000), "ms");
+            if (canvas->total_seam_cost() < result.final_seam_cost) {
+                result.final_seam_cost = canvas->total_seam_cost();
+                result.image = canvas->copy();
+                if (keep_seams) {
+                    result.seams = canvas->seam_visualization();
+                }
+                result.nanoseconds += timer.tik();
+            }
+        }
+        Log::instance().end_progress();
+        result.rejected = canvas->rejections();
+        return result;
+    }
+};
@@ -0,0 +1,276 @@
+#pragma once
+
+#include <atomic>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "image.hpp"
+#include "job.hpp"
+#include "log.hpp"
+#include "texture_cache.hpp"
+
+
+/// Buffered reads and whole writes on a connected socket
+class Connection {
+private:
+    int fd;
+    std::string buffer;
+
+    bool fill() {
+        char chunk[1 << 16];
+        ssize_t size = ::read(fd, chunk, sizeof(chunk));
+        if (size <= 0) {
+            return false;
+        }
+        buffer.append(chunk, size);
+        return true;
+    }
+
+public:
+    explicit Connection(int fd): fd(fd) {}
+
+    ~Connection() {
+        ::close(fd);
+    }
+
+    Connection(const Connection &) = delete;
+    Connection &operator = (const Connection &) = delete;
+
+    /// Longest line `read_line` accepts, newline excluded
+    static constexpr size_t max_line = 1 << 16;
+
+    /// Read up to a newline (dropped), false at the end of the stream or if the line exceeds `max_line` (`too_long` tells)
+    bool read_line(std::string &line, bool &too_long) {
+        size_t end, searched = 0;
+        too_long = false;
+        while ((end = buffer.find('\n', searched)) == std::string::npos) {
+            if (buffer.size() > max_line) {
+                too_long = true;
+                return false;
+            }
+            searched = buffer.size(); // Only the new bytes are searched next
+            if (not fill()) {
+                return false;
+            }
+        }
+        if (end > max_line) {
+            too_long = true;
+            return false;
+        }
+        line = buffer.substr(0, end);
+        buffer.erase(0, end + 1);
+        return true;
+    }
+
+    /// Largest payload `read_bytes` accepts
+    static constexpr size_t max_bytes = size_t(1) << 28;
+
+    /// Read exactly `size` bytes, false at the end of the stream or if `size` exceeds `max_bytes`
+    bool read_bytes(size_t size, std::vector<uint8_t> &bytes) {
+        if (size > max_bytes) {
+            return false;
+        }
+        while (buffer.size() < size) {
+            if (not fill()) {
+                return false;
+            }
+        }
+        bytes.assign(buffer.begin(), buffer.begin() + size);
+        buffer.erase(0, size);
+        return true;
+    }
+
+    bool write(const void *data, size_t size) {
+        for (auto *bytes = static_cast<const char*> (data); size > 0;) {
+            ssize_t written = ::send(fd, bytes, size, MSG_NOSIGNAL);
+            if (written <= 0) {
+                return false;
+            }
+            bytes += written, size -= written;
+        }
+        return true;
+    }
+
+    bool write(const std::string &text) {
+        return write(text.data(), text.size());
+    }
+};
+
+
+/// Long-running synthesis over a Unix domain socket, keeping the textures and their matching data in a cache between
+/// requests.
+///
+/// A request is a manifest line (see `Job::parse`), where the input `@<n>` means the next `n` bytes are the image file
+/// itself and the output `-` returns the PNG instead of writing it. The answer is a line
+/// `ok <iterations> <initial seam cost> <final seam cost> <nanoseconds> <png bytes>` followed by the PNG bytes (none
+/// unless the output is `-`), or `error <reason>`. A connection may send any number of requests, `shutdown` stops the
+/// server. A connection idle for `idle_timeout` seconds is closed so that it does not keep a worker, and so is one whose
+/// payload size cannot be read or whose request line exceeds `Connection::max_line`, as the stream cannot be followed
+/// past them.
+class Server {
+private:
+    int listener = -1;
+    std::atomic<bool> stopping = false;
+    std::vector<std::string> defaults;
+    TextureCache &cache;
+    std::mutex output;
+
+    // Open connections, shut down by `stop` to wake up the workers blocked reading them
+    std::mutex connections_mutex;
+    std::set<int> connections;
+
+    /// Run a request whose `@<n>` payload (if any) is already in `bytes`, return the answer line and fill `png` if the
+    /// result is returned, and `graph_stats` with the table of `--graph-stats summary`
+    std::string handle(const std::string &line, const std::vector<uint8_t> &bytes, std::vector<uint8_t> &png,
+                       std::string &graph_stats) {
+        Job job;
+        std::string error;
+        if (not Job::parse(line, defaults, job, error)) {
+            return "error " + error;
+        }
+        auto texture = job.input.rfind('@', 0) == 0 ? cache.get(bytes.data(), bytes.size()) : cache.get(job.input);
+        if (not texture) {
+            return "error Unable to load image from " + job.input;
+        }
+
+        JobResult result;
+        try {
+            result = synthesize(job, texture);
+        } catch (const std::bad_alloc &) {
+            return "error out of memory";
+        } catch (const std::exception &exception) {
+            return std::string("error ") + exception.what();
+        }
+        graph_stats = result.graph_stats;
+        if (not result.error.empty()) {
+            return "error " + result.error;
+        }
+        if (job.output == "-") {
+            png = result.image->encode_png();
+        }
+        return "ok " + std::to_string(result.iterations) + " " + std::to_string(result.initial_seam_cost) + " " +
+               std::to_string(result.final_seam_cost) + " " + std::to_string(result.nanoseconds) + " " +
+               std::to_string(png.size());
+    }
+
+    void serve(Connection &connection) {
+        for (std::string line;;) {
+            bool too_long;
+            if (not connection.read_line(line, too_long)) {
+                if (too_long) { // Its end is still to come, so the stream cannot be followed past it
+                    connection.write("error request line too long\n");
+                }
+                return;
+            }
+            if (line == "shutdown") {
+                connection.write("ok\n");
+                stop();
+                return;
+            }
+
+            // Take the payload off the stream before anything else can fail, or it would be read as requests
+            NanoTimer timer;
+            std::vector<uint8_t> bytes;
+            std::stringstream stream(line);
+            std::string input;
+            if (stream >> input and input.rfind('@', 0) == 0) {
+                char *end;
+                size_t size = std::strtoull(input.c_str() + 1, &end, 10);
+                if (input.size() == 1 or *end or not connection.read_bytes(size, bytes)) {
+                    connection.write("error bad image size " + input + "\n");
+                    return;
+                }
+            }
+            std::vector<uint8_t> png;
+            std::string graph_stats;
+            auto answer = handle(line, bytes, png, graph_stats);
+            {
+                std::lock_guard<std::mutex> guard(output);
+                std::cout << line.substr(0, line.find(' ', line.find(' ') + 1)) << ": " << answer << " ("
+                          << pretty_nanoseconds(timer.tik()) << ")" << std::endl << graph_stats;
+            }
+            if (not connection.write(answer + "\n") or not connection.write(png.data(), png.size())) {
+                return;
+            }
+        }
+    }
+
+    void stop() {
+        stopping = true;
+        ::shutdown(listener, SHUT_RDWR); // Wakes up the workers blocked in `accept`
+        std::lock_guard<std::mutex> guard(connections_mutex);
+        for (int fd: connections) { // And those waiting for a request, a running one still sends its answer
+            ::shutdown(fd, SHUT_RD);
+        }
+    }
+
+public:
+    /// Seconds a connection may wait for its next request or the rest of one
+    static constexpr int idle_timeout = 60;
+
+    Server(std::vector<std::string> defaults, TextureCache &cache): defaults(std::move(defaults)), cache(cache) {}
+
+    /// Listen on `path` (replacing a stale socket file) and serve with `workers` threads until a `shutdown` request
+    void run(const std::string &path, int workers) {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            std::cerr << "Socket path too long: " << path << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        std::strcpy(address.sun_path, path.c_str());
+        ::unlink(path.c_str());
+        listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0 or ::bind(listener, reinterpret_cast<sockaddr*> (&address), sizeof(address)) < 0 or
+            ::listen(listener, 64) < 0) {
+            std::cerr << "Unable to listen on " << path << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        Log::instance().set_verbosity(Verbosity::quiet);
+        std::cout << "Listening on " << path << " with " << workers << " workers ..." << std::endl;
+
+        auto worker = [this]() {
+            while (not stopping) {
+                int fd = ::accept(listener, nullptr, nullptr);
+                if (fd < 0) {
+                    continue;
+                }
+                timeval timeout = {idle_timeout, 0};
+                ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                {
+                    std::lock_guard<std::mutex> guard(connections_mutex);
+                    if (stopping) { // Accepted just before `stop`, which did not see it
+                        ::close(fd);
+                        continue;
+                    }
+                    connections.insert(fd);
+                }
+                Connection connection(fd);
+                serve(connection);
+                std::lock_guard<std::mutex> guard(connections_mutex);
+                connections.erase(fd); // Before `connection` closes it, the number may be reused right away
+            }
+        };
+        std::vector<std::thread> threads;
+        for (int i = 0; i < std::max(1, workers); ++ i) {
+            threads.emplace_back(worker);
+        }
+        for (auto &thread: threads) {
+            thread.join();
+        }
+        ::close(listener);
+        ::unlink(path.c_str());
+        std::cout << "Stopped" << std::endl;
+    }
+};
@@ -0,0 +1,149 @@
+#include <algorithm>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "image.hpp"
+#include "log.hpp"
+#include "options.hpp"
+#include "placer.hpp"
+#include "profiler.hpp"
+#include "refiner.hpp"
+
+
+/// Phase times of one job, `other` is what no phase covers (matching setup, refinement bookkeeping)
+struct JobTimes {
+    uint64_t phases[static_cast<int> (Phase::count)] = {};
+    uint64_t total = 0, other = 0;
+    uint64_t seam_cost = 0;
+};
+
+
+/// Fill and refine `canvas_size`^2 from `path` with a fixed seed, quietly
+JobTimes run_job(const std::string &path, int canvas_size, uint32_t seed, const Options &options) {
+    RandomSeeder::seed(seed);
+    Log::instance().set_verbosity(Verbosity::quiet);
+    auto &profiler = Profiler::instance();
+    profiler.reset();
+
+    NanoTimer timer;
+    auto texture = std::make_shared<Image>(path);
+    auto canvas = std::make_shared<Canvas>(canvas_size, canvas_size);
+    canvas->seam_cost = options.seam_cost;
+    canvas->acceptance = options.acceptance;
+    Placer::init(canvas, texture);
+    auto result = Refiner::refine(canvas, texture, options.placement, options.criteria);
+
+    JobTimes times;
+    times.total = timer.tik();
+    times.other = times.total;
+    for (int i = 0; i < static_cast<int> (Phase::count); ++ i) {
+        times.phases[i] = profiler.time(static_cast<Phase> (i));
+        times.other -= std::min(times.other, times.phases[i]);
+    }
+    times.seam_cost = result.final_seam_cost;
+    RandomSeeder::unseed();
+    return times;
+}
+
+
+int main(int argc, char* argv[]) {
+#ifdef GRAPH_CUT_NO_PROFILE
+    // Every phase would read 0 and all the time would land in `other`
+    std::cerr << "synth_bench reports the profiler phases, which this build compiled out (GRAPH_CUT_PROFILE=OFF)" << std::endl;
+    std::exit(EXIT_FAILURE);
+#endif
+
+    // Bench arguments first, the rest are synthesis options (20 refining patches unless given)
+    std::string directory = "images/originals";
+    std::vector<int> sizes = {128, 256};
+    uint32_t seed = 1;
+    std::vector<std::string> args = {"--iterations", "20"};
+    for (int i = 1; i < argc; ++ i) {
+        std::string arg = argv[i];
+        if ((arg == "--sizes" or arg == "--seed") and i + 1 < argc) {
+            std::string value = argv[++ i];
+            if (arg == "--seed") {
+                seed = std::stoul(value);
+                continue;
+            }
+            sizes.clear();
+            std::stringstream stream(value);
+            for (std::string size; std::getline(stream, size, ',');) {
+                sizes.push_back(std::stoi(size));
+            }
+        } else if (arg == "--help") {
+            std::cout << "Usage: synth_bench [directory] [--sizes <n,...>] [--seed <n>] [options]" << std::endl;
+            std::cout << "Example: synth_bench images/originals --sizes 128,256,512 --seam-cost gradient" << std::endl;
+            Options::usage();
+            std::exit(EXIT_SUCCESS);
+        } else if (i == 1 and arg.rfind("--", 0) != 0) {
+            directory = arg;
+        } else {
+            args.push_back(arg);
+        }
+    }
+    auto options = Options::parse(args);
+
+    std::vector<std::string> paths;
+    for (const auto &entry: std::filesystem::directory_iterator(directory)) {
+        paths.push_back(entry.path().string());
+    }
+    std::sort(paths.begin(), paths.end());
+    if (paths.empty()) {
+        std::cerr << "No textures in " << directory << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    // One row per job, times in milliseconds
+    auto column = [](const std::string &title, int width=12) {
+        std::cout << std::setw(width) << title;
+    };
+    std::cout << std::left << std::setw(24) << "texture" << std::right;
+    column("canvas", 8), column("total");
+    for (int i = 0; i < static_cast<int> (Phase::count); ++ i) {
+        column(Profiler::name(static_cast<Phase> (i)));
+    }
+    column("other"), column("seam cost");
+    std::cout << std::endl;
+
+    JobTimes sum;
+    auto milliseconds = [](uint64_t nanoseconds) {
+        std::stringstream stream;
+        stream << std::fixed << std::setprecision(1) << nanoseconds / 1e6;
+        return stream.str();
+    };
+    for (int size: sizes) {
+        for (const auto &path: paths) {
+            auto times = run_job(path, size, seed, options);
+            std::cout << std::left << std::setw(24) << std::filesystem::path(path).filename().string() << std::right;
+            column(std::to_string(size), 8), column(milliseconds(times.total));
+            for (int i = 0; i < static_cast<int> (Phase::count); ++ i) {
+                column(milliseconds(times.phases[i]));
+                sum.phases[i] += times.phases[i];
+            }
+            column(milliseconds(times.other)), column(std::to_string(times.seam_cost));
+            std::cout << std::endl;
+            sum.total += times.total, sum.other += times.other;
+        }
+    }
+
+    // Share of each phase over all the jobs
+    std::cout << std::left << std::setw(24) << "share" << std::right;
+    column("", 8), column(milliseconds(sum.total));
+    auto share = [&sum](uint64_t nanoseconds) {
+        std::stringstream stream;
+        stream << std::fixed << std::setprecision(1) << 100.0 * nanoseconds / std::max<uint64_t>(sum.total, 1) << "%";
+        return stream.str();
+    };
+    for (int i = 0; i < static_cast<int> (Phase::count); ++ i) {
+        column(share(sum.phases[i]));
+    }
+    column(share(sum.other));
+    std::cout << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,297 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "image.hpp"
+#include "matching.hpp"
+
+
+/// Decoded textures with their matching data (see `MatchingData`), keyed by a hash of the file contents so the same
+/// texture is prepared once whatever its path or however it arrives. The hash only finds the candidate: the file
+/// contents are kept with each texture (and in its spill file) and compared in full, so colliding contents never share
+/// a texture, the later one is prepared apart and not cached. Each is decoded by the first caller while the others
+/// wait, with its planes, gradients and matching data built before any job sees it (their lazy construction is not
+/// thread-safe). Beyond a memory budget the least recently used textures are dropped, after being written with their
+/// matching data into the spill directory if any, from where a later miss reads them back instead of decoding them.
+class TextureCache {
+private:
+    typedef std::shared_ptr<const std::vector<uint8_t>> Source;
+
+    struct Entry {
+        std::shared_future<std::shared_ptr<Image>> texture;
+        Source source; // The file contents the texture was decoded from
+        uint64_t last_use = 0;
+    };
+
+    // A texture taken out of `entries` to be spilled
+    struct Spilled {
+        uint64_t key;
+        std::shared_ptr<Image> texture;
+        Source source;
+    };
+
+    std::mutex mutex;
+    std::map<uint64_t, Entry> entries;
+    uint64_t clock = 0;
+    size_t budget;
+    std::string directory;
+
+    static constexpr char magic[8] = {'G', 'C', 'T', 'E', 'X', 'T', '0', '2'};
+
+    /// Largest spilled texture read back, in pixels and spectra, beyond that the file is taken for damaged
+    static constexpr int64_t max_pixels = int64_t(1) << 28;
+    static constexpr int64_t max_spectra = 1 << 10;
+
+    [[nodiscard]] static size_t bytes(const Image &texture) {
+        size_t pixels = static_cast<size_t> (texture.w) * texture.h;
+        return pixels * (sizeof(Pixel) + 3 * sizeof(float) + 2 * sizeof(float)) +
+               (texture.matching_cache ? texture.matching_cache->bytes() : 0);
+    }
+
+    [[nodiscard]] static bool same(const Source &source, const uint8_t *bytes, size_t size) {
+        return source->size() == size and std::equal(source->begin(), source->end(), bytes);
+    }
+
+    [[nodiscard]] std::string spill_path(uint64_t hash) const {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.texture", static_cast<unsigned long long> (hash));
+        return (std::filesystem::path(directory) / name).string();
+    }
+
+    /// Write a texture with its file contents and matching data, through a temporary file so readers never see a partial one. Skipped if
+    /// the file already holds as much (the same spectra, as a texture only gains them). The temporary name is unique to
+    /// the process and the call, as threads or other processes sharing the directory may spill the same texture.
+    void spill(uint64_t hash, const std::shared_ptr<Image> &texture, const Source &source) const {
+        auto &matching = MatchingData::of(texture);
+        auto spectra = matching.all_spectra();
+        size_t pixels = static_cast<size_t> (texture->w) * texture->h;
+        uintmax_t size = sizeof(magic) + 5 * sizeof(int64_t) + source->size() + pixels * (sizeof(Pixel) + sizeof(uint64_t));
+        for (const auto &[dft_size, spectrum]: spectra) {
+            size += 2 * sizeof(int32_t) + static_cast<size_t> (dft_size.first) * dft_size.second * sizeof(ComplexPixel);
+        }
+        static std::atomic<uint64_t> spills = 0;
+        auto path = spill_path(hash);
+        auto temporary = path + "." + std::to_string(::getpid()) + "." + std::to_string(spills ++) + ".tmp";
+        std::error_code error;
+        if (std::filesystem::file_size(path, error) == size) {
+            return;
+        }
+
+        std::ofstream file(temporary, std::ios::binary);
+        auto put = [&file](const void *data, size_t size) {
+            file.write(static_cast<const char*> (data), static_cast<std::streamsize> (size));
+        };
+        int64_t header[5] = {static_cast<int64_t> (source->size()), texture->w, texture->h,
+                             static_cast<int64_t> (matching.variance), static_cast<int64_t> (spectra.size())};
+        put(magic, sizeof(magic));
+        put(header, sizeof(header));
+        put(source->data(), source->size());
+        put(texture->data, pixels * sizeof(Pixel));
+        put(matching.square_sums.data(), matching.square_sums.size() * sizeof(uint64_t));
+        for (const auto &[size, spectrum]: spectra) {
+            int32_t dft_size[2] = {size.first, size.second};
+            put(dft_size, sizeof(dft_size));
+            put(spectrum.get(), static_cast<size_t> (size.first) * size.second * sizeof(ComplexPixel));
+        }
+        file.close();
+        if (file) {
+            std::filesystem::rename(temporary, path, error);
+        } else {
+            std::filesystem::remove(temporary, error);
+        }
+    }
+
+    /// Read a spilled texture back, `nullptr` if there is none, it is damaged or it was spilled from other file contents
+    /// with the same hash. Sizes from the file are checked against the bytes it has left before anything is allocated.
+    [[nodiscard]] std::shared_ptr<Image> unspill(uint64_t hash, const uint8_t *bytes, size_t size) const {
+        auto path = spill_path(hash);
+        std::error_code error;
+        uintmax_t remaining = std::filesystem::file_size(path, error);
+        std::ifstream file(path, std::ios::binary);
+        if (error or not file) {
+            return nullptr;
+        }
+        auto get = [&file, &remaining](void *data, size_t size) {
+            if (size > remaining) {
+                return false;
+            }
+            remaining -= size;
+            return static_cast<bool> (file.read(static_cast<char*> (data), static_cast<std::streamsize> (size)));
+        };
+        char file_magic[sizeof(magic)];
+        int64_t header[5];
+        if (not get(file_magic, sizeof(file_magic)) or std::memcmp(file_magic, magic, sizeof(magic)) != 0 or
+            not get(header, sizeof(header)) or header[0] != static_cast<int64_t> (size)) {
+            return nullptr;
+        }
+        std::vector<uint8_t> source(size);
+        if (not get(source.data(), size) or not std::equal(source.begin(), source.end(), bytes) or
+            header[1] <= 0 or header[2] <= 0 or header[1] > max_pixels / header[2] or header[4] < 0 or
+            header[4] > max_spectra or
+            static_cast<uintmax_t> (header[1] * header[2]) > remaining / (sizeof(Pixel) + sizeof(uint64_t))) {
+            return nullptr;
+        }
+        auto texture = std::make_shared<Image>(static_cast<int> (header[1]), static_cast<int> (header[2]));
+        auto matching = std::make_shared<MatchingData>();
+        size_t pixels = static_cast<size_t> (texture->w) * texture->h;
+        matching->variance = header[3];
+        matching->square_sums.resize(pixels);
+        if (not get(texture->data, pixels * sizeof(Pixel)) or not get(matching->square_sums.data(), pixels * sizeof(uint64_t))) {
+            return nullptr;
+        }
+        for (int64_t i = 0; i < header[4]; ++ i) {
+            int32_t dft_size[2];
+            if (not get(dft_size, sizeof(dft_size)) or dft_size[0] <= 0 or dft_size[1] <= 0) {
+                return nullptr;
+            }
+            size_t length = static_cast<size_t> (dft_size[0]) * dft_size[1];
+            if (length > remaining / sizeof(ComplexPixel)) {
+                return nullptr;
+            }
+            std::shared_ptr<ComplexPixel> spectrum(static_cast<ComplexPixel*> (std::malloc(length * sizeof(ComplexPixel))), dft_free);
+            if (not spectrum or not get(spectrum.get(), length * sizeof(ComplexPixel))) {
+                return nullptr;
+            }
+            matching->add_spectrum(dft_size[0], dft_size[1], spectrum);
+        }
+        texture->matching_cache = matching;
+        return texture;
+    }
+
+    [[nodiscard]] std::shared_ptr<Image> prepare(uint64_t hash, const uint8_t *bytes, size_t size) const {
+        auto texture = directory.empty() ? nullptr : unspill(hash, bytes, size);
+        if (not texture) {
+            texture = Image::decode(bytes, size);
+        }
+        if (texture) {
+            static_cast<void> (texture->planes());
+            static_cast<void> (texture->gradients());
+            static_cast<void> (MatchingData::of(texture));
+        }
+        return texture;
+    }
+
+public:
+    /// Keep about `budget` bytes of textures, spill into `directory` unless empty
+    explicit TextureCache(size_t budget, std::string directory=""): budget(budget), directory(std::move(directory)) {
+        if (not this->directory.empty()) {
+            std::error_code error;
+            std::filesystem::create_directories(this->directory, error);
+        }
+    }
+
+    /// 64-bit FNV-1a
+    [[nodiscard]] static uint64_t hash(const uint8_t *bytes, size_t size) {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (size_t i = 0; i < size; ++ i) {
+            hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    /// The texture of an image file in memory, `nullptr` if it is not an image
+    [[nodiscard]] std::shared_ptr<Image> get(const uint8_t *bytes, size_t size) {
+        uint64_t key = hash(bytes, size);
+        std::promise<std::shared_ptr<Image>> promise;
+        std::shared_future<std::shared_ptr<Image>> texture;
+        Source source;
+        bool first = false;
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            auto &entry = entries[key];
+            if (not entry.texture.valid()) {
+                entry.texture = promise.get_future().share();
+                entry.source = std::make_shared<const std::vector<uint8_t>>(bytes, bytes + size);
+                first = true;
+            }
+            entry.last_use = ++ clock;
+            texture = entry.texture, source = entry.source;
+        }
+        if (not first and not same(source, bytes, size)) { // A hash collision, which must not get that texture
+            return prepare(key, bytes, size);
+        }
+        if (first) {
+            auto prepared = prepare(key, bytes, size);
+            if (not prepared) { // Gone before it is ready, so `evict` and `spill_all` never see a null texture
+                std::lock_guard<std::mutex> guard(mutex);
+                entries.erase(key);
+            }
+            promise.set_value(prepared);
+            evict();
+        }
+        return texture.get();
+    }
+
+    /// The texture of an image file, `nullptr` if it cannot be read or is not an image
+    [[nodiscard]] std::shared_ptr<Image> get(const std::string &path) {
+        std::ifstream file(path, std::ios::binary);
+        if (not file) {
+            return nullptr;
+        }
+        std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        return get(bytes.data(), bytes.size());
+    }
+
+    /// Drop the least recently used textures (ready ones only) until within the budget, the last one is always kept
+    void evict() {
+        std::vector<Spilled> evicted;
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            size_t total = 0;
+            std::vector<std::pair<uint64_t, uint64_t>> ready; // Last use and key
+            for (const auto &[key, entry]: entries) {
+                if (entry.texture.wait_for(std::chrono::seconds(0)) == std::future_status::ready and entry.texture.get()) {
+                    total += bytes(*entry.texture.get()) + entry.source->size();
+                    ready.emplace_back(entry.last_use, key);
+                }
+            }
+            std::sort(ready.begin(), ready.end());
+            for (int i = 0; total > budget and i + 1 < ready.size(); ++ i) {
+                const auto &entry = entries[ready[i].second];
+                total -= bytes(*entry.texture.get()) + entry.source->size();
+                evicted.push_back(Spilled{ready[i].second, entry.texture.get(), entry.source});
+                entries.erase(ready[i].second);
+            }
+        }
+        if (not directory.empty()) {
+            for (const auto &[key, texture, source]: evicted) {
+                spill(key, texture, source);
+            }
+        }
+    }
+
+    /// Write every texture held into the spill directory, if any (e.g. before exiting)
+    void spill_all() {
+        if (directory.empty()) {
+            return;
+        }
+        std::vector<Spilled> ready;
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            for (const auto &[key, entry]: entries) {
+                if (entry.texture.wait_for(std::chrono::seconds(0)) == std::future_status::ready and entry.texture.get()) {
+                    ready.push_back(Spilled{key, entry.texture.get(), entry.source});
+                }
+            }
+        }
+        for (const auto &[key, texture, source]: ready) {
+            spill(key, texture, source);
+        }
+    }
+};
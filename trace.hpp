@@ -0,0 +1,143 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "cherry.hpp"
+
+
+/// Timeline of begin/end events in the Chrome trace JSON format (chrome://tracing, ui.perfetto.dev), off unless opened
+class Tracer {
+private:
+    struct Event {
+        const char *name;
+        char phase; // 'B' or 'E'
+        uint64_t nanoseconds;
+        int thread;
+        std::string args;
+    };
+
+    std::atomic<bool> on = false;
+    std::mutex mutex;
+    std::vector<Event> events;
+    std::string path;
+    uint64_t origin = 0;
+
+    // Small per-thread numbers instead of the opaque `std::thread::id`
+    static int thread_index() {
+        static std::atomic<int> threads = 0;
+        thread_local int index = ++ threads;
+        return index;
+    }
+
+public:
+    static Tracer &instance() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    /// Start recording, the events are written into `path` by `close`
+    void open(const std::string &trace_path) {
+        std::lock_guard<std::mutex> guard(mutex);
+        path = trace_path, origin = NanoTimer::now();
+        events.clear();
+        on = true;
+    }
+
+    [[nodiscard]] bool enabled() const {
+        return on;
+    }
+
+    /// Record an event, `args` is the inside of a JSON object (may be empty)
+    void record(const char *name, char phase, std::string args) {
+        uint64_t now = NanoTimer::now();
+        std::lock_guard<std::mutex> guard(mutex);
+        events.push_back(Event{name, phase, now - origin, thread_index(), std::move(args)});
+    }
+
+    /// Stop recording and write the events
+    void close() {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (not on) {
+            return;
+        }
+        on = false;
+        std::ofstream file(path);
+        if (not file) {
+            std::cerr << "Unable to write trace to " << path << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        for (int i = 0; i < events.size(); ++ i) {
+            const auto &event = events[i];
+            char timestamp[32];
+            std::snprintf(timestamp, sizeof(timestamp), "%.3f", event.nanoseconds / 1e3);
+            file << "{\"name\": \"" << event.name << "\", \"ph\": \"" << event.phase << "\", \"ts\": " << timestamp
+                 << ", \"pid\": 1, \"tid\": " << event.thread << ", \"args\": {" << event.args << "}}"
+                 << (i + 1 < events.size() ? ",\n" : "\n");
+        }
+        file << "]}" << std::endl;
+        events.clear();
+    }
+};
+
+
+/// A begin/end pair around a scope, arguments added during the scope go into the end event (the viewers merge both)
+class TraceScope {
+private:
+    const char *name;
+    bool active;
+    std::string args;
+    TraceScope *parent;
+
+    static TraceScope *&innermost() {
+        thread_local TraceScope *scope = nullptr;
+        return scope;
+    }
+
+    static void append(std::string &args, const char *key, int64_t value) {
+        args += (args.empty() ? "\"" : ", \"") + std::string(key) + "\": " + std::to_string(value);
+    }
+
+public:
+    explicit TraceScope(const char *name, std::initializer_list<std::pair<const char*, int64_t>> begin_args={}):
+            name(name), active(Tracer::instance().enabled()), parent(innermost()) {
+        innermost() = this;
+        if (active) {
+            std::string begin;
+            for (const auto &[key, value]: begin_args) {
+                append(begin, key, value);
+            }
+            Tracer::instance().record(name, 'B', std::move(begin));
+        }
+    }
+
+    ~TraceScope() {
+        innermost() = parent;
+        if (active) {
+            Tracer::instance().record(name, 'E', std::move(args));
+        }
+    }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator = (const TraceScope &) = delete;
+
+    void arg(const char *key, int64_t value) {
+        if (active) {
+            append(args, key, value);
+        }
+    }
+
+    /// Add an argument to the innermost scope of this thread, if any
+    static void annotate(const char *key, int64_t value) {
+        if (innermost()) {
+            innermost()->arg(key, value);
+        }
+    }
+};